@@ -0,0 +1,216 @@
+/*
+Microbenchmarks of the CPU side of vulkan_minimal_compute: the checksums, LZ77, filtering and
+inflate inside lodepng, converting the rendered floats, and whole frames from floats to a png
+in memory at several resolutions. None of it needs a GPU; the image is the one shader.comp renders,
+computed on the CPU once before timing. The GPU side is timed by vulkan_minimal_compute --bench-kernel.
+
+Usage: bench [--json FILE] [--label TEXT] [--filter TEXT] [--min-time SECONDS]
+
+Every benchmark runs until it took --min-time seconds, at least 5 times, and the median time of
+a run is reported. With --json, the results are also written as JSON, which bench/compare.py
+compares between two builds to find regressions.
+*/
+
+// lodepng.cpp is included instead of linked, to reach the static functions it doesn't export.
+#include "lodepng.cpp"
+#include "convert.h"
+#include "reference.h"
+#include "json.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+struct Result {
+    std::string name;
+    size_t bytes; // the input bytes of one run.
+    int runs;
+    double medianSeconds;
+    double minSeconds;
+};
+
+static std::vector<Result> results;
+static const char* filterText = NULL;
+static double minTime = 0.5;
+
+// Keeps the compiler from dropping work whose result is never used.
+static volatile unsigned sink;
+
+/*
+Times func, which processes `bytes` bytes of input per call, and records it as `name`.
+Skipped if --filter is given and not part of the name.
+*/
+template<typename Func>
+static void run(const std::string& name, size_t bytes, Func func) {
+    if (filterText && name.find(filterText) == std::string::npos) {
+        return;
+    }
+    func(); // warm up the caches and the allocator.
+    std::vector<double> times;
+    double total = 0;
+    while (total < minTime || times.size() < 5) {
+        auto start = std::chrono::steady_clock::now();
+        func();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        times.push_back(seconds);
+        total += seconds;
+    }
+    std::sort(times.begin(), times.end());
+    Result result = { name, bytes, (int)times.size(), times[times.size() / 2], times[0] };
+    results.push_back(result);
+    printf("%-28s %10.3f ms %10.1f MB/s %6d runs\n", name.c_str(), result.medianSeconds * 1e3,
+        bytes / result.medianSeconds / 1e6, result.runs);
+}
+
+static void check(unsigned error) {
+    if (error) {
+        printf("lodepng error %u: %s\n", error, lodepng_error_text(error));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void benchmarkLodepng() {
+    const unsigned w = 1600, h = 1200;
+    std::vector<float> floats = renderReference(w, h);
+    std::vector<unsigned char> rgba(floats.size());
+    floatsToUint8(rgba.data(), floats.data(), floats.size());
+
+    run("crc32", rgba.size(), [&]() { sink = lodepng_crc32(rgba.data(), rgba.size()); });
+    run("adler32", rgba.size(), [&]() { sink = update_adler32(1u, rgba.data(), (unsigned)rgba.size()); });
+
+    LodePNGColorMode color;
+    lodepng_color_mode_init(&color);
+    LodePNGEncoderSettings encoder;
+    lodepng_encoder_settings_init(&encoder);
+    // The filter types are followed by the filtered rows, which is what deflate gets.
+    std::vector<unsigned char> filtered((size_t)h * (w * 4 + 1));
+    run("filter", rgba.size(), [&]() { check(filter(filtered.data(), rgba.data(), w, h, &color, &encoder)); });
+
+    const LodePNGCompressSettings& compress = encoder.zlibsettings;
+    run("encodeLZ77", filtered.size(), [&]() {
+        Hash hash;
+        uivector lz77;
+        uivector_init(&lz77);
+        check(hash_init(&hash, compress.windowsize));
+        check(encodeLZ77(&lz77, &hash, filtered.data(), 0, filtered.size(), compress.windowsize,
+                         compress.minmatch, compress.nicematch, compress.lazymatching));
+        sink = (unsigned)lz77.size;
+        hash_cleanup(&hash);
+        uivector_cleanup(&lz77);
+    });
+    run("deflate", filtered.size(), [&]() {
+        unsigned char* out = NULL;
+        size_t outsize = 0;
+        check(lodepng_deflate(&out, &outsize, filtered.data(), filtered.size(), &compress));
+        sink = (unsigned)outsize;
+        lodepng_free(out);
+    });
+
+    unsigned char* deflated = NULL;
+    size_t deflatedSize = 0;
+    check(lodepng_deflate(&deflated, &deflatedSize, filtered.data(), filtered.size(), &compress));
+    LodePNGDecompressSettings decompress;
+    lodepng_decompress_settings_init(&decompress);
+    // Measured by the inflated bytes, like the encoders are by their input.
+    run("inflate", filtered.size(), [&]() {
+        unsigned char* out = NULL;
+        size_t outsize = 0;
+        check(lodepng_inflate(&out, &outsize, deflated, deflatedSize, &decompress));
+        sink = (unsigned)outsize;
+        lodepng_free(out);
+    });
+    lodepng_free(deflated);
+
+    std::vector<unsigned char> png;
+    check(lodepng::encode(png, rgba, w, h));
+    run("decode", rgba.size(), [&]() {
+        std::vector<unsigned char> image;
+        unsigned dw, dh;
+        check(lodepng::decode(image, dw, dh, png));
+        sink = (unsigned)image.size();
+    });
+}
+
+static void benchmarkConversion() {
+    const unsigned w = 3200, h = 2400;
+    std::vector<float> floats = renderReference(w, h);
+    std::vector<unsigned char> out(2 * floats.size());
+    // Measured by the float bytes read.
+    run("convert_rgba8", floats.size() * sizeof(float), [&]() { floatsToUint8(out.data(), floats.data(), floats.size()); });
+    run("convert_rgba16", floats.size() * sizeof(float), [&]() { floatsToUint16BE(out.data(), floats.data(), floats.size()); });
+}
+
+/*
+What vulkan_minimal_compute does with a rendered frame, after reading it back: convert the floats
+to 8-bit RGBA and encode them as png, with an encoder set up like the one of ComputeApplication,
+which compresses bands of 64 rows on all cores and keeps its memory between frames.
+*/
+static void benchmarkFrames() {
+    const unsigned sizes[][2] = { { 640, 480 }, { 1600, 1200 }, { 3200, 2400 } };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        unsigned w = sizes[i][0], h = sizes[i][1];
+        std::vector<float> floats = renderReference(w, h);
+        std::vector<unsigned char> rgba(floats.size());
+        lodepng::Encoder encoder;
+        encoder.state.encoder.band_rows = 64;
+        std::vector<unsigned char> png;
+        run("frame_" + std::to_string(w) + "x" + std::to_string(h), floats.size() * sizeof(float), [&]() {
+            floatsToUint8(rgba.data(), floats.data(), floats.size());
+            check(encoder.encode(png, rgba, w, h));
+            sink = (unsigned)png.size();
+        });
+    }
+}
+
+static void writeJson(const char* filename, const char* label) {
+    FILE* f = fopen(filename, "w");
+    if (!f) {
+        printf("can't write %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(f, "{\n  \"label\": ");
+    writeJsonString(f, label);
+    fprintf(f, ",\n  \"benchmarks\": [\n");
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        fprintf(f, "    {\"name\": ");
+        writeJsonString(f, r.name);
+        fprintf(f, ", \"bytes\": %zu, \"runs\": %d, \"median_ns\": %.0f, \"min_ns\": %.0f, \"mb_per_s\": %.2f}%s\n",
+            r.bytes, r.runs, r.medianSeconds * 1e9, r.minSeconds * 1e9, r.bytes / r.medianSeconds / 1e6,
+            i + 1 < results.size() ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    fclose(f);
+}
+
+int main(int argc, char** argv) {
+    const char* jsonFile = NULL;
+    const char* label = "";
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            jsonFile = argv[++i];
+        } else if (strcmp(argv[i], "--label") == 0 && i + 1 < argc) {
+            label = argv[++i];
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filterText = argv[++i];
+        } else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+            minTime = atof(argv[++i]);
+        } else {
+            printf("usage: %s [--json FILE] [--label TEXT] [--filter TEXT] [--min-time SECONDS]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    benchmarkLodepng();
+    benchmarkConversion();
+    benchmarkFrames();
+
+    if (jsonFile) {
+        writeJson(jsonFile, label);
+    }
+    return EXIT_SUCCESS;
+}
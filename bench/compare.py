@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+"""
+Compares two results of `bench --json FILE` or `corpus --json FILE`, usually of two commits, and
+flags the benchmarks whose median time grew by more than the threshold. For the results of corpus,
+which also record compressed_bytes and decode_median_ns, a size that grew by more than the size
+threshold and a median decode time that grew by more than the threshold are flagged too.
+
+Usage: compare.py OLD.json NEW.json [--threshold PERCENT] [--size-threshold PERCENT]
+
+Exits with 1 if any benchmark regressed, so it can fail a CI job.
+"""
+
+import argparse
+import json
+import sys
+
+
+def load(filename):
+    with open(filename) as f:
+        data = json.load(f)
+    return data.get("label", ""), {b["name"]: b for b in data["benchmarks"]}
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compare two bench --json results.")
+    parser.add_argument("old")
+    parser.add_argument("new")
+    parser.add_argument("--threshold", type=float, default=5.0,
+                        help="percent of extra time that counts as a regression (default 5)")
+    parser.add_argument("--size-threshold", type=float, default=0.0,
+                        help="percent of extra compressed bytes that counts as a regression (default 0)")
+    args = parser.parse_args()
+
+    old_label, old = load(args.old)
+    new_label, new = load(args.new)
+    print("old: %s (%s)" % (args.old, old_label))
+    print("new: %s (%s)" % (args.new, new_label))
+    print("%-28s %12s %12s %9s" % ("benchmark", "old ms", "new ms", "change"))
+
+    regressions = []
+    for name, n in new.items():
+        if name not in old:
+            print("%-28s %12s %12.3f %9s" % (name, "-", n["median_ns"] / 1e6, "new"))
+            continue
+        o = old[name]
+        change = (n["median_ns"] / o["median_ns"] - 1.0) * 100.0
+        flag = ""
+        if change > args.threshold:
+            flag = "  REGRESSION"
+            regressions.append(name)
+        elif change < -args.threshold:
+            flag = "  faster"
+        line = "%-28s %12.3f %12.3f %+8.1f%%" % (name, o["median_ns"] / 1e6, n["median_ns"] / 1e6, change)
+        if "compressed_bytes" in o and "compressed_bytes" in n:
+            size_change = (float(n["compressed_bytes"]) / o["compressed_bytes"] - 1.0) * 100.0
+            line += " size %+.2f%%" % size_change
+            if size_change > args.size_threshold:
+                flag += "  SIZE REGRESSION"
+                if name not in regressions:
+                    regressions.append(name)
+        if "decode_median_ns" in o and "decode_median_ns" in n:
+            decode_change = (n["decode_median_ns"] / o["decode_median_ns"] - 1.0) * 100.0
+            line += " decode %+.1f%%" % decode_change
+            if decode_change > args.threshold:
+                flag += "  DECODE REGRESSION"
+                if name not in regressions:
+                    regressions.append(name)
+        print(line + flag)
+    for name in old:
+        if name not in new:
+            print("%-28s %12.3f %12s %9s" % (name, old[name]["median_ns"] / 1e6, "-", "removed"))
+
+    if regressions:
+        print("%d regression(s): %s" % (len(regressions), ", ".join(regressions)))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,284 @@
+/*
+Encodes a fixed corpus of images with every combination of a grid of LodePNGCompressSettings and
+every LodePNGFilterStrategy, to choose the settings by what they cost and gain instead of blindly.
+
+The corpus is deterministic: mandelbrot renders of a few views with a few palettes, as
+vulkan_minimal_compute could save them, plus random noise and a flat image as the extremes.
+For every combination the compressed bytes and the median encode and decode time of the runs are recorded.
+
+Usage: corpus [--json FILE] [--label TEXT] [--runs N]
+
+It prints, for the whole corpus, a table per combination sorted by size, which marks the ones on
+the Pareto front of size against encode speed (no other combination is both smaller and faster)
+with `e`, and of size against decode speed with `d`. With --json, every image and combination is
+written in the format of `bench --json`, plus its compressed bytes and decode time, so bench/compare.py
+also flags a combination that compresses or decodes worse than before.
+*/
+
+#include "lodepng.h"
+#include "reference.h"
+#include "json.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+struct CorpusImage {
+    std::string name;
+    unsigned w, h;
+    std::vector<unsigned char> rgba;
+};
+
+struct Combination {
+    std::string name;
+    LodePNGEncoderSettings settings;
+};
+
+struct Measurement {
+    size_t compressedBytes;
+    double encodeSeconds; // the median of the runs, as bench reports it.
+    double encodeMinSeconds; // the fastest of the runs.
+    double decodeSeconds; // the median of the runs.
+};
+
+const unsigned CORPUS_WIDTH = 480, CORPUS_HEIGHT = 360;
+
+enum Palette {
+    PALETTE_COSINE, // the colors of shader.comp.
+    PALETTE_GREY,   // the iterations as grey levels.
+    PALETTE_BANDS,  // black and white for even and odd iterations, the worst case for prediction.
+};
+
+static CorpusImage renderImage(const char* name, float cx, float cy, float scale, Palette palette) {
+    CorpusImage image = { name, CORPUS_WIDTH, CORPUS_HEIGHT, std::vector<unsigned char>(4 * CORPUS_WIDTH * CORPUS_HEIGHT) };
+    for (unsigned y = 0; y < image.h; ++y) {
+        for (unsigned x = 0; x < image.w; ++x) {
+            int n = referenceIterations(x, y, image.w, image.h, cx, cy, scale);
+            unsigned char* pixel = &image.rgba[4 * (image.w * y + x)];
+            if (palette == PALETTE_COSINE) {
+                float rgb[3];
+                referenceColor(n, rgb);
+                for (int c = 0; c < 3; ++c) pixel[c] = (unsigned char)(255.0f * rgb[c]);
+            } else if (palette == PALETTE_GREY) {
+                pixel[0] = pixel[1] = pixel[2] = (unsigned char)(n * 255 / REFERENCE_ITERATIONS);
+            } else {
+                pixel[0] = pixel[1] = pixel[2] = (n & 1) ? 255 : 0;
+            }
+            pixel[3] = 255;
+        }
+    }
+    return image;
+}
+
+static std::vector<CorpusImage> makeCorpus() {
+    std::vector<CorpusImage> corpus;
+    corpus.push_back(renderImage("default_cosine", -0.445f, 0.0f, 2.34f, PALETTE_COSINE));
+    corpus.push_back(renderImage("default_grey", -0.445f, 0.0f, 2.34f, PALETTE_GREY));
+    corpus.push_back(renderImage("seahorse_cosine", -0.7453f, 0.1127f, 0.0065f, PALETTE_COSINE));
+    corpus.push_back(renderImage("seahorse_bands", -0.7453f, 0.1127f, 0.0065f, PALETTE_BANDS));
+    corpus.push_back(renderImage("elephant_grey", 0.2823f, 0.0101f, 0.01f, PALETTE_GREY));
+
+    CorpusImage noise = { "noise", CORPUS_WIDTH, CORPUS_HEIGHT, std::vector<unsigned char>(4 * CORPUS_WIDTH * CORPUS_HEIGHT) };
+    unsigned state = 12345; // a fixed seed, so the corpus is the same every time.
+    for (size_t i = 0; i < noise.rgba.size(); ++i) {
+        state = state * 1103515245u + 12345u;
+        noise.rgba[i] = (i % 4 == 3) ? 255 : (unsigned char)(state >> 24);
+    }
+    corpus.push_back(noise);
+
+    CorpusImage flat = { "flat", CORPUS_WIDTH, CORPUS_HEIGHT, std::vector<unsigned char>(4 * CORPUS_WIDTH * CORPUS_HEIGHT) };
+    for (size_t i = 0; i < flat.rgba.size(); i += 4) {
+        flat.rgba[i] = 77; flat.rgba[i + 1] = 77; flat.rgba[i + 2] = 128; flat.rgba[i + 3] = 255;
+    }
+    corpus.push_back(flat);
+    return corpus;
+}
+
+/*
+Every filter strategy, with stored and fixed Huffman blocks, and dynamic blocks with a grid of the
+LZ77 settings that trade speed for size.
+*/
+static std::vector<Combination> makeCombinations() {
+    const struct { LodePNGFilterStrategy strategy; const char* name; } strategies[] = {
+        { LFS_ZERO, "zero" }, { LFS_MINSUM, "minsum" }, { LFS_ENTROPY, "entropy" }, { LFS_BRUTE_FORCE, "brute" },
+    };
+    std::vector<Combination> combinations;
+    for (size_t s = 0; s < sizeof(strategies) / sizeof(strategies[0]); ++s) {
+        Combination c;
+        lodepng_encoder_settings_init(&c.settings);
+        c.settings.filter_strategy = strategies[s].strategy;
+        std::string prefix = std::string(strategies[s].name) + "/";
+
+        c.name = prefix + "stored";
+        c.settings.zlibsettings.btype = 0;
+        combinations.push_back(c);
+        c.name = prefix + "fixed";
+        c.settings.zlibsettings.btype = 1;
+        combinations.push_back(c);
+
+        c.settings.zlibsettings.btype = 2;
+        const unsigned windowsizes[] = { 2048, 32768 };
+        const unsigned nicematches[] = { 128, 258 };
+        for (int w = 0; w < 2; ++w) {
+            for (int n = 0; n < 2; ++n) {
+                for (unsigned lazy = 0; lazy < 2; ++lazy) {
+                    for (unsigned split = 0; split < 2; ++split) {
+                        c.settings.zlibsettings.windowsize = windowsizes[w];
+                        c.settings.zlibsettings.nicematch = nicematches[n];
+                        c.settings.zlibsettings.lazymatching = lazy;
+                        c.settings.zlibsettings.blocksplitting = split;
+                        c.name = prefix + "dynamic_w" + std::to_string(windowsizes[w]) + "_n" + std::to_string(nicematches[n]) +
+                                 (lazy ? "_lazy" : "") + (split ? "_split" : "");
+                        combinations.push_back(c);
+                    }
+                }
+            }
+        }
+    }
+    return combinations;
+}
+
+static void check(unsigned error) {
+    if (error) {
+        printf("lodepng error %u: %s\n", error, lodepng_error_text(error));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static double seconds(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static double median(std::vector<double> times) {
+    std::sort(times.begin(), times.end());
+    size_t n = times.size();
+    return n % 2 ? times[n / 2] : (times[n / 2 - 1] + times[n / 2]) / 2;
+}
+
+// Encodes and decodes image with the combination `runs` times, and checks that the pixels survive.
+static Measurement measure(const CorpusImage& image, const Combination& combination, int runs) {
+    Measurement m;
+    std::vector<double> encodeTimes, decodeTimes;
+    std::vector<unsigned char> png;
+    for (int run = 0; run < runs; ++run) {
+        lodepng::State state;
+        state.encoder = combination.settings;
+        png.clear();
+        auto start = std::chrono::steady_clock::now();
+        check(lodepng::encode(png, image.rgba, image.w, image.h, state));
+        encodeTimes.push_back(seconds(start));
+    }
+    m.compressedBytes = png.size();
+    m.encodeSeconds = median(encodeTimes);
+    m.encodeMinSeconds = *std::min_element(encodeTimes.begin(), encodeTimes.end());
+
+    std::vector<unsigned char> decoded;
+    for (int run = 0; run < runs; ++run) {
+        unsigned w, h;
+        decoded.clear();
+        auto start = std::chrono::steady_clock::now();
+        check(lodepng::decode(decoded, w, h, png));
+        decodeTimes.push_back(seconds(start));
+    }
+    m.decodeSeconds = median(decodeTimes);
+    if (decoded != image.rgba) {
+        printf("%s with %s doesn't decode to the same pixels\n", image.name.c_str(), combination.name.c_str());
+        exit(EXIT_FAILURE);
+    }
+    return m;
+}
+
+int main(int argc, char** argv) {
+    const char* jsonFile = NULL;
+    const char* label = "";
+    int runs = 3;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            jsonFile = argv[++i];
+        } else if (strcmp(argv[i], "--label") == 0 && i + 1 < argc) {
+            label = argv[++i];
+        } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            runs = atoi(argv[++i]);
+        } else {
+            printf("usage: %s [--json FILE] [--label TEXT] [--runs N]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::vector<CorpusImage> corpus = makeCorpus();
+    std::vector<Combination> combinations = makeCombinations();
+    // measurements[c][i] is image i encoded with combination c.
+    std::vector<std::vector<Measurement> > measurements(combinations.size());
+    size_t rawBytes = 0;
+    for (size_t i = 0; i < corpus.size(); ++i) rawBytes += corpus[i].rgba.size();
+
+    for (size_t c = 0; c < combinations.size(); ++c) {
+        for (size_t i = 0; i < corpus.size(); ++i) {
+            measurements[c].push_back(measure(corpus[i], combinations[c], runs));
+        }
+    }
+
+    // The totals over the corpus per combination.
+    struct Total { size_t c, bytes; double encodeSeconds, decodeSeconds; bool encodeFront, decodeFront; };
+    std::vector<Total> totals;
+    for (size_t c = 0; c < combinations.size(); ++c) {
+        Total t = { c, 0, 0, 0, true, true };
+        for (size_t i = 0; i < corpus.size(); ++i) {
+            t.bytes += measurements[c][i].compressedBytes;
+            t.encodeSeconds += measurements[c][i].encodeSeconds;
+            t.decodeSeconds += measurements[c][i].decodeSeconds;
+        }
+        totals.push_back(t);
+    }
+    for (size_t a = 0; a < totals.size(); ++a) {
+        for (size_t b = 0; b < totals.size(); ++b) {
+            if (totals[b].bytes > totals[a].bytes) continue;
+            bool smaller = totals[b].bytes < totals[a].bytes;
+            if (totals[b].encodeSeconds < totals[a].encodeSeconds ||
+                (smaller && totals[b].encodeSeconds == totals[a].encodeSeconds)) totals[a].encodeFront = false;
+            if (totals[b].decodeSeconds < totals[a].decodeSeconds ||
+                (smaller && totals[b].decodeSeconds == totals[a].decodeSeconds)) totals[a].decodeFront = false;
+        }
+    }
+    std::sort(totals.begin(), totals.end(), [](const Total& a, const Total& b) { return a.bytes < b.bytes; });
+
+    printf("%zu images, %zu raw bytes; e/d: on the Pareto front of size against encode/decode speed\n", corpus.size(), rawBytes);
+    printf("%-40s %10s %7s %11s %11s\n", "combination", "bytes", "ratio", "enc MB/s", "dec MB/s");
+    for (size_t k = 0; k < totals.size(); ++k) {
+        const Total& t = totals[k];
+        printf("%-40s %10zu %7.2f %11.1f %11.1f %c%c\n", combinations[t.c].name.c_str(), t.bytes, double(rawBytes) / t.bytes,
+            rawBytes / t.encodeSeconds / 1e6, rawBytes / t.decodeSeconds / 1e6, t.encodeFront ? 'e' : ' ', t.decodeFront ? 'd' : ' ');
+    }
+
+    if (jsonFile) {
+        FILE* f = fopen(jsonFile, "w");
+        if (!f) {
+            printf("can't write %s\n", jsonFile);
+            return EXIT_FAILURE;
+        }
+        fprintf(f, "{\n  \"label\": ");
+        writeJsonString(f, label);
+        fprintf(f, ",\n  \"benchmarks\": [\n");
+        for (size_t c = 0; c < combinations.size(); ++c) {
+            for (size_t i = 0; i < corpus.size(); ++i) {
+                const Measurement& m = measurements[c][i];
+                size_t bytes = corpus[i].rgba.size();
+                fprintf(f, "    {\"name\": ");
+                writeJsonString(f, corpus[i].name + "/" + combinations[c].name);
+                // median_ns and min_ns are of the encoding, as in bench --json, decode_median_ns of the decoding.
+                fprintf(f, ", \"bytes\": %zu, \"runs\": %d, \"median_ns\": %.0f, \"min_ns\": %.0f, \"decode_median_ns\": %.0f, "
+                           "\"compressed_bytes\": %zu, \"encode_mb_per_s\": %.2f, \"decode_mb_per_s\": %.2f}%s\n",
+                    bytes, runs, m.encodeSeconds * 1e9, m.encodeMinSeconds * 1e9, m.decodeSeconds * 1e9, m.compressedBytes,
+                    bytes / m.encodeSeconds / 1e6, bytes / m.decodeSeconds / 1e6,
+                    c + 1 == combinations.size() && i + 1 == corpus.size() ? "" : ",");
+            }
+        }
+        fprintf(f, "  ]\n}\n");
+        fclose(f);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,22 @@
+/*
+Writing the results of the benchmarks in this directory as JSON.
+*/
+#ifndef BENCH_JSON_H
+#define BENCH_JSON_H
+
+#include <stdio.h>
+#include <string>
+
+// Writes the string s to f as a JSON string.
+inline void writeJsonString(FILE* f, const std::string& s) {
+    fputc('"', f);
+    for (size_t i = 0; i < s.size(); ++i) {
+        unsigned char c = (unsigned char)s[i];
+        if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+        else if (c < 0x20) fprintf(f, "\\u%04x", c);
+        else fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+#endif /*BENCH_JSON_H*/
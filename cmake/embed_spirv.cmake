@@ -0,0 +1,21 @@
+# Writes the SPIR-V binary SPV as a C++ header HEADER that defines it as `constexpr uint32_t NAME[]`.
+# Run by CMakeLists.txt with cmake -DSPV=... -DHEADER=... -DNAME=... -P embed_spirv.cmake.
+
+file(READ "${SPV}" hex HEX)
+string(LENGTH "${hex}" length)
+math(EXPR remainder "${length} % 8")
+if (length EQUAL 0 OR NOT remainder EQUAL 0)
+    message(FATAL_ERROR "${SPV} is not a SPIR-V binary made of 32-bit words")
+endif()
+
+# SPIR-V words are little endian, so reverse the bytes of every word to write it as a number.
+string(REGEX REPLACE "(..)(..)(..)(..)" "0x\\4\\3\\2\\1u, " words "${hex}")
+# Eight words to a line.
+set(word "0x........u, ")
+string(REGEX REPLACE "(${word}${word}${word}${word}${word}${word}${word}${word})" "\\1\n    " words "${words}")
+
+file(WRITE "${HEADER}"
+    "// Generated by cmake/embed_spirv.cmake from ${SPV}, do not edit.\n"
+    "#pragma once\n"
+    "#include <stdint.h>\n\n"
+    "constexpr uint32_t ${NAME}[] = {\n    ${words}\n};\n")
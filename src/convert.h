@@ -0,0 +1,58 @@
+/*
+Conversions of the float colors the compute shaders render to the integer samples of the saved images.
+Used by main.cpp when saving, and by bench/bench.cpp to time them without a GPU.
+*/
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <stddef.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h> // Used to convert floats to 16-bit integers 8 at a time.
+#define HAVE_SSE2 1
+#endif
+
+/*
+Converts count floats to bytes, the sample format of 8-bit png, by scaling them by 255 and
+truncating. The floats must be in [0, 1], as the cosine palette of the shaders makes them.
+*/
+inline void floatsToUint8(unsigned char* out, const float* in, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = (unsigned char)(255.0f * in[i]);
+    }
+}
+
+/*
+Converts count floats to 16-bit big endian integers, the sample format of 16-bit png.
+The floats are clamped to [0, 1] and rounded, and NaN becomes 0.
+*/
+inline void floatsToUint16BE(unsigned char* out, const float* in, size_t count) {
+    size_t i = 0;
+#ifdef HAVE_SSE2
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 scale = _mm_set1_ps(65535.0f);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128i bias = _mm_set1_epi32(32768);
+    const __m128i flip = _mm_set1_epi16((short)0x8000);
+    for (size_t end = count - count % 8; i != end; i += 8) {
+        // _mm_max_ps returns its second operand for NaN, so NaN is clamped to 0 as well.
+        __m128 a = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(in + i), zero), one);
+        __m128 b = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(in + i + 4), zero), one);
+        __m128i ia = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(a, scale), half));
+        __m128i ib = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(b, scale), half));
+        // SSE2 can only pack 32 bits to signed 16 bits, so move the values into that range and back.
+        __m128i v = _mm_xor_si128(_mm_packs_epi32(_mm_sub_epi32(ia, bias), _mm_sub_epi32(ib, bias)), flip);
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)); // swap to big endian.
+        _mm_storeu_si128((__m128i*)(out + 2 * i), v);
+    }
+#endif
+    for (; i < count; ++i) {
+        float v = !(in[i] > 0.0f) ? 0.0f : (in[i] > 1.0f ? 1.0f : in[i]);
+        unsigned value = (unsigned)(v * 65535.0f + 0.5f);
+        out[2 * i] = (unsigned char)(value >> 8);
+        out[2 * i + 1] = (unsigned char)(value & 255);
+    }
+}
+
+#endif /*CONVERT_H*/
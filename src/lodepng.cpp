@@ -34,6 +34,20 @@ Rename this file to lodepng.cpp to use it for C++, or to lodepng.c to use it for
 #include <stdio.h>
 #include <stdlib.h>
 
+#ifdef LODEPNG_COMPILE_THREADS
+#include <thread>
+#include <vector>
+#endif /*LODEPNG_COMPILE_THREADS*/
+
+/*With ENABLE_METRICS, deflate and inflate count their work in the per-thread counters of metrics.h,
+which come with vulkan_minimal_compute. Otherwise the counting compiles to nothing.*/
+#if defined(ENABLE_METRICS) && defined(__cplusplus)
+#include "metrics.h"
+#define LODEPNG_COUNT(metric, n) metricsAdd(metric, n)
+#else /*ENABLE_METRICS*/
+#define LODEPNG_COUNT(metric, n)
+#endif /*ENABLE_METRICS*/
+
 #if defined(_MSC_VER) && (_MSC_VER >= 1310) /*Visual Studio: A few warning types are not desired here.*/
 #pragma warning( disable : 4244 ) /*implicit conversions: not warned by gcc -Wall -Wextra and requires too much casts*/
 #pragma warning( disable : 4996 ) /*VS does not like fopen, but fopen_s is not standard C so unusable here*/
@@ -59,19 +73,209 @@ define them in your own project's source files without needing to change
 lodepng source code. Don't forget to remove "static" if you copypaste them
 from here.*/
 
+#ifdef LODEPNG_COMPILE_ENCODER
+/*alignment of the memory handed out by a LodePNGArena, and size of the header before each allocation*/
+#define ARENA_ALIGN 16u
+#define ARENA_ROUND(size) (((size) + (ARENA_ALIGN - 1u)) & ~(size_t)(ARENA_ALIGN - 1u))
+
+/*A block of memory of a LodePNGArena, followed by the memory it hands out*/
+typedef struct ArenaBlock
+{
+  struct ArenaBlock* next; /*the block used before this one*/
+  size_t size; /*bytes available after the header*/
+  size_t used; /*bytes handed out, including allocation headers*/
+  size_t last; /*offset of the most recent allocation, or size if it was freed*/
+} ArenaBlock;
+
+#define ARENA_BLOCK_HEADER ARENA_ROUND(sizeof(ArenaBlock))
+
+static unsigned char* arena_block_data(ArenaBlock* block)
+{
+  return (unsigned char*)block + ARENA_BLOCK_HEADER;
+}
+
+/*returns the block the pointer was allocated from, or NULL if it's not from this arena*/
+static ArenaBlock* arena_find_block(LodePNGArena* arena, void* ptr)
+{
+  ArenaBlock* block;
+  for(block = (ArenaBlock*)arena->blocks; block; block = block->next)
+  {
+    unsigned char* data = arena_block_data(block);
+    if((unsigned char*)ptr > data && (unsigned char*)ptr < data + block->size) return block;
+  }
+  return 0;
+}
+
+/*the size the user asked for, stored in the header before the allocation*/
+static size_t arena_alloc_size(void* ptr)
+{
+  return *(size_t*)((unsigned char*)ptr - ARENA_ALIGN);
+}
+
+static void* arena_malloc(LodePNGArena* arena, size_t size)
+{
+  ArenaBlock* block = (ArenaBlock*)arena->blocks;
+  size_t needed = ARENA_ALIGN + ARENA_ROUND(size);
+  unsigned char* p;
+  if(needed < size) return 0; /*overflow*/
+
+  if(!block || block->size - block->used < needed)
+  {
+    /*grow geometrically, so that growing vectors need few blocks*/
+    size_t blocksize = arena->blocksize;
+    if(block && block->size * 2 > blocksize) blocksize = block->size * 2;
+    if(blocksize < needed) blocksize = needed;
+    block = (ArenaBlock*)malloc(ARENA_BLOCK_HEADER + blocksize);
+    if(!block) return 0;
+    block->next = (ArenaBlock*)arena->blocks;
+    block->size = blocksize;
+    block->used = 0;
+    block->last = blocksize;
+    arena->blocks = block;
+    ++arena->numblocks;
+  }
+
+  p = arena_block_data(block) + block->used;
+  *(size_t*)p = size;
+  block->last = block->used;
+  block->used += needed;
+  ++arena->numallocs;
+  arena->inuse += needed;
+  if(arena->inuse > arena->peak) arena->peak = arena->inuse;
+  return p + ARENA_ALIGN;
+}
+
+/*returns whether ptr is the most recent allocation of block, which can change size in place*/
+static int arena_is_last(ArenaBlock* block, void* ptr)
+{
+  return block->last != block->size && (unsigned char*)ptr == arena_block_data(block) + block->last + ARENA_ALIGN;
+}
+
+static void arena_free(LodePNGArena* arena, ArenaBlock* block, void* ptr)
+{
+  arena->inuse -= ARENA_ALIGN + ARENA_ROUND(arena_alloc_size(ptr));
+  if(arena_is_last(block, ptr))
+  {
+    block->used = block->last;
+    block->last = block->size;
+  }
+}
+
+static void* arena_realloc(LodePNGArena* arena, ArenaBlock* block, void* ptr, size_t new_size)
+{
+  size_t old_size = arena_alloc_size(ptr);
+  void* result;
+  if(arena_is_last(block, ptr) && block->size - block->last >= ARENA_ALIGN + ARENA_ROUND(new_size)
+     && ARENA_ROUND(new_size) >= new_size)
+  {
+    arena->inuse += ARENA_ROUND(new_size);
+    arena->inuse -= ARENA_ROUND(old_size);
+    if(arena->inuse > arena->peak) arena->peak = arena->inuse;
+    block->used = block->last + ARENA_ALIGN + ARENA_ROUND(new_size);
+    *(size_t*)((unsigned char*)ptr - ARENA_ALIGN) = new_size;
+    ++arena->numallocs;
+    return ptr;
+  }
+  result = arena_malloc(arena, new_size);
+  if(!result) return 0;
+  memcpy(result, ptr, old_size < new_size ? old_size : new_size);
+  arena_free(arena, block, ptr);
+  return result;
+}
+
+void lodepng_arena_init(LodePNGArena* arena)
+{
+  arena->blocksize = 1024 * 1024;
+  arena->numallocs = arena->numblocks = arena->peak = 0;
+  arena->blocks = 0;
+  arena->inuse = 0;
+}
+
+void lodepng_arena_cleanup(LodePNGArena* arena)
+{
+  ArenaBlock* block = (ArenaBlock*)arena->blocks;
+  while(block)
+  {
+    ArenaBlock* next = block->next;
+    free(block);
+    block = next;
+  }
+  arena->blocks = 0;
+  arena->inuse = 0;
+}
+
+void lodepng_arena_reset(LodePNGArena* arena)
+{
+  ArenaBlock* block = (ArenaBlock*)arena->blocks;
+  if(block && block->next)
+  {
+    size_t total = 0;
+    for(; block; block = block->next) total += block->size;
+    lodepng_arena_cleanup(arena);
+    block = (ArenaBlock*)malloc(ARENA_BLOCK_HEADER + total);
+    if(block)
+    {
+      block->next = 0;
+      block->size = total;
+      arena->blocks = block;
+    }
+  }
+  if(block)
+  {
+    block->used = 0;
+    block->last = block->size;
+  }
+  arena->numallocs = arena->numblocks = arena->peak = 0;
+  arena->inuse = 0;
+}
+#endif /*LODEPNG_COMPILE_ENCODER*/
+
 #ifdef LODEPNG_COMPILE_ALLOCATORS
+#ifdef LODEPNG_COMPILE_ENCODER
+/*the arena of the encode running on this thread, see LodePNGState::arena*/
+#if defined(LODEPNG_COMPILE_THREADS)
+static thread_local LodePNGArena* lodepng_thread_arena = 0;
+#elif defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L)
+static _Thread_local LodePNGArena* lodepng_thread_arena = 0;
+#else
+static LodePNGArena* lodepng_thread_arena = 0; /*only safe if encoding on one thread at a time*/
+#endif
+#endif /*LODEPNG_COMPILE_ENCODER*/
+
 static void* lodepng_malloc(size_t size)
 {
+#ifdef LODEPNG_COMPILE_ENCODER
+  if(lodepng_thread_arena) return arena_malloc(lodepng_thread_arena, size);
+#endif /*LODEPNG_COMPILE_ENCODER*/
   return malloc(size);
 }
 
 static void* lodepng_realloc(void* ptr, size_t new_size)
 {
+#ifdef LODEPNG_COMPILE_ENCODER
+  if(lodepng_thread_arena)
+  {
+    ArenaBlock* block = ptr ? arena_find_block(lodepng_thread_arena, ptr) : 0;
+    if(block) return arena_realloc(lodepng_thread_arena, block, ptr, new_size);
+    if(!ptr) return arena_malloc(lodepng_thread_arena, new_size);
+  }
+#endif /*LODEPNG_COMPILE_ENCODER*/
   return realloc(ptr, new_size);
 }
 
 static void lodepng_free(void* ptr)
 {
+#ifdef LODEPNG_COMPILE_ENCODER
+  if(lodepng_thread_arena && ptr)
+  {
+    ArenaBlock* block = arena_find_block(lodepng_thread_arena, ptr);
+    if(block)
+    {
+      arena_free(lodepng_thread_arena, block, ptr);
+      return;
+    }
+  }
+#endif /*LODEPNG_COMPILE_ENCODER*/
   free(ptr);
 }
 #else /*LODEPNG_COMPILE_ALLOCATORS*/
@@ -123,6 +327,51 @@ Example: if(!uivector_resizev(&frequencies_ll, 286, 0)) ERROR_BREAK(83);
   return;\
 }
 
+#ifdef LODEPNG_COMPILE_PNG
+/*
+Calls func(context, i) for every i in [0, count), each on its own thread if LODEPNG_COMPILE_THREADS
+is enabled, with the calling thread doing task 0. Otherwise, or if a thread can't be started, the
+tasks simply run one after another, so results may never depend on the order in which they run.
+Encoder tasks may use lodepng_malloc, but the encoder's arena only exists on the calling thread, so other
+tasks get their memory from malloc. The caller may free what a task allocated, since lodepng_free tells
+the two apart, but a task may never free or realloc memory the caller allocated.
+*/
+static void lodepng_run_tasks(void (*func)(void*, unsigned), void* context, unsigned count)
+{
+  unsigned i;
+#ifdef LODEPNG_COMPILE_THREADS
+  std::vector<std::thread> threads;
+  for(i = 1; i < count; ++i)
+  {
+    try
+    {
+      threads.push_back(std::thread(func, context, i));
+    }
+    catch(...)
+    {
+      func(context, i);
+    }
+  }
+  if(count) func(context, 0);
+  for(i = 0; i != threads.size(); ++i) threads[i].join();
+#else /*LODEPNG_COMPILE_THREADS*/
+  for(i = 0; i != count; ++i) func(context, i);
+#endif /*LODEPNG_COMPILE_THREADS*/
+}
+
+/*Returns in how many tasks to split work of the given size, such that every task gets at least
+minsize of it and there are no more tasks than hardware threads. Always at least 1.*/
+static unsigned lodepng_num_tasks(size_t size, size_t minsize)
+{
+  size_t n = 1;
+#ifdef LODEPNG_COMPILE_THREADS
+  n = std::thread::hardware_concurrency();
+#endif /*LODEPNG_COMPILE_THREADS*/
+  if(size / minsize < n) n = size / minsize;
+  return n ? (unsigned)n : 1;
+}
+#endif /*LODEPNG_COMPILE_PNG*/
+
 /*
 About uivector, ucvector and string:
 -All of them wrap dynamic arrays or text strings in a similar way.
@@ -667,75 +916,33 @@ static unsigned HuffmanTree_makeFromLengths(HuffmanTree* tree, const unsigned* b
 
 #ifdef LODEPNG_COMPILE_ENCODER
 
-/*BPM: Boundary Package Merge, see "A Fast and Space-Economical Algorithm for Length-Limited Coding",
-Jyrki Katajainen, Alistair Moffat, Andrew Turpin, 1995.*/
-
-/*chain node for boundary package merge*/
-typedef struct BPMNode
-{
-  int weight; /*the sum of all weights in this chain*/
-  unsigned index; /*index of this leaf node (called "count" in the paper)*/
-  struct BPMNode* tail; /*the next nodes in this chain (null if last)*/
-  int in_use;
-} BPMNode;
-
-/*lists of chains*/
-typedef struct BPMLists
-{
-  /*memory pool*/
-  unsigned memsize;
-  BPMNode* memory;
-  unsigned numfree;
-  unsigned nextfree;
-  BPMNode** freelist;
-  /*two heads of lookahead chains per list*/
-  unsigned listsize;
-  BPMNode** chains0;
-  BPMNode** chains1;
-} BPMLists;
+/*
+The code lengths are computed in two steps, without allocating for the amounts of symbols deflate uses:
+-the in-place algorithm of "In-Place Calculation of Minimum-Redundancy Codes", Alistair Moffat and
+ Jyrki Katajainen, 1995, gives optimal lengths without limit, using only the array of sorted weights.
+-if the longest code is longer than maxbitlen, too long codes are cut to maxbitlen and the Kraft sum
+ is restored by moving the deepest possible shorter codes one level down, as zlib and miniz do.
+ This is optimal when no code is too long, and close to optimal otherwise.
+*/
 
-/*creates a new chain node with the given parameters, from the memory in the lists */
-static BPMNode* bpmnode_create(BPMLists* lists, int weight, unsigned index, BPMNode* tail)
+/*a symbol with non-zero frequency*/
+typedef struct HuffmanLeaf
 {
-  unsigned i;
-  BPMNode* result;
-
-  /*memory full, so garbage collect*/
-  if(lists->nextfree >= lists->numfree)
-  {
-    /*mark only those that are in use*/
-    for(i = 0; i != lists->memsize; ++i) lists->memory[i].in_use = 0;
-    for(i = 0; i != lists->listsize; ++i)
-    {
-      BPMNode* node;
-      for(node = lists->chains0[i]; node != 0; node = node->tail) node->in_use = 1;
-      for(node = lists->chains1[i]; node != 0; node = node->tail) node->in_use = 1;
-    }
-    /*collect those that are free*/
-    lists->numfree = 0;
-    for(i = 0; i != lists->memsize; ++i)
-    {
-      if(!lists->memory[i].in_use) lists->freelist[lists->numfree++] = &lists->memory[i];
-    }
-    lists->nextfree = 0;
-  }
+  unsigned weight;
+  unsigned index;
+} HuffmanLeaf;
 
-  result = lists->freelist[lists->nextfree++];
-  result->weight = weight;
-  result->index = index;
-  result->tail = tail;
-  return result;
-}
+/*maximum amount of symbols for which lodepng_huffman_code_lengths needs no allocation, deflate uses at most 288*/
+#define HUFFMAN_STACK_CODES 320
 
-/*sort the leaves with stable mergesort*/
-static void bpmnode_sort(BPMNode* leaves, size_t num)
+/*sort the leaves by weight with stable bottom-up mergesort, mem must have room for num leaves*/
+static void huffman_sort_leaves(HuffmanLeaf* leaves, HuffmanLeaf* mem, size_t num)
 {
-  BPMNode* mem = (BPMNode*)lodepng_malloc(sizeof(*leaves) * num);
   size_t width, counter = 0;
   for(width = 1; width < num; width *= 2)
   {
-    BPMNode* a = (counter & 1) ? mem : leaves;
-    BPMNode* b = (counter & 1) ? leaves : mem;
+    HuffmanLeaf* a = (counter & 1) ? mem : leaves;
+    HuffmanLeaf* b = (counter & 1) ? leaves : mem;
     size_t p;
     for(p = 0; p < num; p += 2 * width)
     {
@@ -751,61 +958,132 @@ static void bpmnode_sort(BPMNode* leaves, size_t num)
     counter++;
   }
   if(counter & 1) memcpy(leaves, mem, sizeof(*leaves) * num);
-  lodepng_free(mem);
 }
 
-/*Boundary Package Merge step, numpresent is the amount of leaves, and c is the current chain.*/
-static void boundaryPM(BPMLists* lists, BPMNode* leaves, size_t numpresent, int c, int num)
+/*Replaces num >= 2 weights, sorted ascending, by their optimal code lengths, which are then descending.
+The sum of all weights must fit in an unsigned.*/
+static void huffman_moffat_katajainen(unsigned* a, size_t num)
 {
-  unsigned lastindex = lists->chains1[c]->index;
+  size_t root, leaf, next, avbl, used, depth;
 
-  if(c == 0)
+  /*phase 1: combine the two lightest nodes, like the classic algorithm. Internal nodes are stored in
+  the slots of the leaves they replace, and a node that got a parent stores its parent's index instead*/
+  a[0] += a[1];
+  root = 0;
+  leaf = 2;
+  for(next = 1; next < num - 1; ++next)
   {
-    if(lastindex >= numpresent) return;
-    lists->chains0[c] = lists->chains1[c];
-    lists->chains1[c] = bpmnode_create(lists, leaves[lastindex].weight, lastindex + 1, 0);
+    /*first child*/
+    if(leaf >= num || a[root] < a[leaf])
+    {
+      a[next] = a[root];
+      a[root++] = (unsigned)next;
+    }
+    else a[next] = a[leaf++];
+    /*second child*/
+    if(leaf >= num || (root < next && a[root] < a[leaf]))
+    {
+      a[next] += a[root];
+      a[root++] = (unsigned)next;
+    }
+    else a[next] += a[leaf++];
   }
-  else
+
+  /*phase 2: replace the parent indices of the internal nodes by their depth, the root is at num - 2*/
+  a[num - 2] = 0;
+  for(next = num - 2; next-- > 0;) a[next] = a[a[next]] + 1;
+
+  /*phase 3: every level has room for twice the internal nodes of the level above, the rest are leaves*/
+  avbl = 1;
+  used = depth = 0;
+  root = num - 1; /*one past the next internal node, they're visited from shallow to deep*/
+  next = num; /*one past the next leaf to give a length*/
+  while(avbl > 0)
   {
-    /*sum of the weights of the head nodes of the previous lookahead chains.*/
-    int sum = lists->chains0[c - 1]->weight + lists->chains1[c - 1]->weight;
-    lists->chains0[c] = lists->chains1[c];
-    if(lastindex < numpresent && sum > leaves[lastindex].weight)
+    while(root > 0 && a[root - 1] == depth)
     {
-      lists->chains1[c] = bpmnode_create(lists, leaves[lastindex].weight, lastindex + 1, lists->chains1[c]->tail);
-      return;
+      ++used;
+      --root;
+    }
+    while(avbl > used)
+    {
+      a[--next] = (unsigned)depth;
+      --avbl;
     }
-    lists->chains1[c] = bpmnode_create(lists, sum, lastindex, lists->chains1[c - 1]);
-    /*in the end we are only interested in the chain of the last list, so no
-    need to recurse if we're at the last one (this gives measurable speedup)*/
-    if(num + 1 < (int)(2 * numpresent - 2))
+    avbl = 2 * used;
+    ++depth;
+    used = 0;
+  }
+}
+
+/*Limits descending code lengths, as given by huffman_moffat_katajainen, to maxbitlen (which is < 32).*/
+static void huffman_limit_lengths(unsigned* lengths, size_t num, unsigned maxbitlen)
+{
+  unsigned count[32]; /*amount of codes per length*/
+  unsigned total = 0; /*Kraft sum in units of 2^-maxbitlen, at most 2^maxbitlen + num*/
+  size_t i;
+  unsigned bits;
+
+  for(bits = 0; bits <= maxbitlen; ++bits) count[bits] = 0;
+  for(i = 0; i != num; ++i) ++count[lengths[i] < maxbitlen ? lengths[i] : maxbitlen];
+  for(bits = 1; bits <= maxbitlen; ++bits) total += count[bits] << (maxbitlen - bits);
+
+  while(total != (1u << maxbitlen))
+  {
+    /*remove a code of maxbitlen, and make room for it by splitting the deepest shorter code in two*/
+    --count[maxbitlen];
+    for(bits = maxbitlen - 1; bits > 0; --bits)
     {
-      boundaryPM(lists, leaves, numpresent, c - 1, num);
-      boundaryPM(lists, leaves, numpresent, c - 1, num);
+      if(count[bits])
+      {
+        --count[bits];
+        count[bits + 1] += 2;
+        break;
+      }
     }
+    --total;
+  }
+
+  /*the lightest symbols come first and get the longest codes*/
+  i = 0;
+  for(bits = maxbitlen; bits > 0; --bits)
+  {
+    unsigned j;
+    for(j = 0; j != count[bits]; ++j) lengths[i++] = bits;
   }
 }
 
 unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequencies,
                                       size_t numcodes, unsigned maxbitlen)
 {
-  unsigned error = 0;
-  unsigned i;
+  HuffmanLeaf stack_leaves[2 * HUFFMAN_STACK_CODES];
+  unsigned stack_work[HUFFMAN_STACK_CODES];
+  HuffmanLeaf* leaves = stack_leaves; /*the symbols, only those with > 0 frequency, then room to sort them*/
+  unsigned* work = stack_work; /*weights and lengths of the sorted leaves*/
+  size_t i;
   size_t numpresent = 0; /*number of symbols with non-zero frequency*/
-  BPMNode* leaves; /*the symbols, only those with > 0 frequency*/
 
   if(numcodes == 0) return 80; /*error: a tree of 0 symbols is not supposed to be made*/
   if((1u << maxbitlen) < numcodes) return 80; /*error: represent all symbols*/
 
-  leaves = (BPMNode*)lodepng_malloc(numcodes * sizeof(*leaves));
-  if(!leaves) return 83; /*alloc fail*/
+  if(numcodes > HUFFMAN_STACK_CODES)
+  {
+    leaves = (HuffmanLeaf*)lodepng_malloc(2 * numcodes * sizeof(*leaves));
+    work = (unsigned*)lodepng_malloc(numcodes * sizeof(*work));
+    if(!leaves || !work)
+    {
+      lodepng_free(leaves);
+      lodepng_free(work);
+      return 83; /*alloc fail*/
+    }
+  }
 
   for(i = 0; i != numcodes; ++i)
   {
     if(frequencies[i] > 0)
     {
-      leaves[numpresent].weight = (int)frequencies[i];
-      leaves[numpresent].index = i;
+      leaves[numpresent].weight = frequencies[i];
+      leaves[numpresent].index = (unsigned)i;
       ++numpresent;
     }
   }
@@ -815,7 +1093,7 @@ unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequen
   /*ensure at least two present symbols. There should be at least one symbol
   according to RFC 1951 section 3.2.7. Some decoders incorrectly require two. To
   make these work as well ensure there are at least two symbols. The
-  Package-Merge code below also doesn't work correctly if there's only one
+  algorithm below also doesn't work correctly if there's only one
   symbol, it'd give it the theoritical 0 bits but in practice zlib wants 1 bit*/
   if(numpresent == 0)
   {
@@ -828,51 +1106,19 @@ unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequen
   }
   else
   {
-    BPMLists lists;
-    BPMNode* node;
-
-    bpmnode_sort(leaves, numpresent);
-
-    lists.listsize = maxbitlen;
-    lists.memsize = 2 * maxbitlen * (maxbitlen + 1);
-    lists.nextfree = 0;
-    lists.numfree = lists.memsize;
-    lists.memory = (BPMNode*)lodepng_malloc(lists.memsize * sizeof(*lists.memory));
-    lists.freelist = (BPMNode**)lodepng_malloc(lists.memsize * sizeof(BPMNode*));
-    lists.chains0 = (BPMNode**)lodepng_malloc(lists.listsize * sizeof(BPMNode*));
-    lists.chains1 = (BPMNode**)lodepng_malloc(lists.listsize * sizeof(BPMNode*));
-    if(!lists.memory || !lists.freelist || !lists.chains0 || !lists.chains1) error = 83; /*alloc fail*/
-
-    if(!error)
-    {
-      for(i = 0; i != lists.memsize; ++i) lists.freelist[i] = &lists.memory[i];
-
-      bpmnode_create(&lists, leaves[0].weight, 1, 0);
-      bpmnode_create(&lists, leaves[1].weight, 2, 0);
-
-      for(i = 0; i != lists.listsize; ++i)
-      {
-        lists.chains0[i] = &lists.memory[0];
-        lists.chains1[i] = &lists.memory[1];
-      }
-
-      /*each boundaryPM call adds one chain to the last list, and we need 2 * numpresent - 2 chains.*/
-      for(i = 2; i != 2 * numpresent - 2; ++i) boundaryPM(&lists, leaves, numpresent, (int)maxbitlen - 1, (int)i);
-
-      for(node = lists.chains1[maxbitlen - 1]; node; node = node->tail)
-      {
-        for(i = 0; i != node->index; ++i) ++lengths[leaves[i].index];
-      }
-    }
-
-    lodepng_free(lists.memory);
-    lodepng_free(lists.freelist);
-    lodepng_free(lists.chains0);
-    lodepng_free(lists.chains1);
+    huffman_sort_leaves(leaves, leaves + numpresent, numpresent);
+    for(i = 0; i != numpresent; ++i) work[i] = leaves[i].weight;
+    huffman_moffat_katajainen(work, numpresent);
+    if(work[0] > maxbitlen) huffman_limit_lengths(work, numpresent, maxbitlen);
+    for(i = 0; i != numpresent; ++i) lengths[leaves[i].index] = work[i];
   }
 
-  lodepng_free(leaves);
-  return error;
+  if(leaves != stack_leaves)
+  {
+    lodepng_free(leaves);
+    lodepng_free(work);
+  }
+  return 0;
 }
 
 /*Create the Huffman tree given the symbol frequencies*/
@@ -1135,6 +1381,7 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
   HuffmanTree tree_ll; /*the huffman tree for literal and length codes*/
   HuffmanTree tree_d; /*the huffman tree for distance codes*/
   size_t inbitlength = inlength * 8;
+  size_t numsymbols = 0; /*literal and length symbols decoded, for the counters*/
 
   HuffmanTree_init(&tree_ll);
   HuffmanTree_init(&tree_d);
@@ -1152,6 +1399,7 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
       if(!ucvector_resize(out, (*pos) + 1)) ERROR_BREAK(83 /*alloc fail*/);
       out->data[*pos] = (unsigned char)code_ll;
       ++(*pos);
+      ++numsymbols;
     }
     else if(code_ll >= FIRST_LENGTH_CODE_INDEX && code_ll <= LAST_LENGTH_CODE_INDEX) /*length code*/
     {
@@ -1202,6 +1450,7 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
         memcpy(out->data + *pos, out->data + backward, length);
         *pos += length;
       }
+      ++numsymbols;
     }
     else if(code_ll == 256)
     {
@@ -1219,6 +1468,7 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
   HuffmanTree_cleanup(&tree_ll);
   HuffmanTree_cleanup(&tree_d);
 
+  LODEPNG_COUNT(METRIC_INFLATE_SYMBOLS, numsymbols);
   return error;
 }
 
@@ -1232,7 +1482,7 @@ static unsigned inflateNoCompression(ucvector* out, const unsigned char* in, siz
   p = (*bp) / 8; /*byte position*/
 
   /*read LEN (2 bytes) and NLEN (2 bytes)*/
-  if(p + 4 >= inlength) return 52; /*error, bit pointer will jump past memory*/
+  if(p + 4 > inlength) return 52; /*error, bit pointer will jump past memory*/
   LEN = in[p] + 256u * in[p + 1]; p += 2;
   NLEN = in[p] + 256u * in[p + 1]; p += 2;
 
@@ -1250,9 +1500,12 @@ static unsigned inflateNoCompression(ucvector* out, const unsigned char* in, siz
   return error;
 }
 
-static unsigned lodepng_inflatev(ucvector* out,
-                                 const unsigned char* in, size_t insize,
-                                 const LodePNGDecompressSettings* settings)
+/*
+Inflates deflate blocks up to and including the final one. If final is 0, the data is instead a part of a
+deflate stream that ends with a full flush: inflating stops at the end of the input, which must come right
+after a block that is not final, such as the empty stored block of the flush.
+*/
+static unsigned inflateBlocks(ucvector* out, const unsigned char* in, size_t insize, unsigned final)
 {
   /*bit pointer in the "in" data, current byte is bp >> 3, current bit is bp & 0x7 (from lsb to msb of the byte)*/
   size_t bp = 0;
@@ -1260,11 +1513,10 @@ static unsigned lodepng_inflatev(ucvector* out,
   size_t pos = 0; /*byte position in the out buffer*/
   unsigned error = 0;
 
-  (void)settings;
-
   while(!BFINAL)
   {
     unsigned BTYPE;
+    if(!final && bp == insize * 8) return 0; /*the end of the flushed part, which the flush byte-aligns*/
     if(bp + 2 >= insize * 8) return 52; /*error, bit pointer will jump past memory*/
     BFINAL = readBitFromStream(&bp, in);
     BTYPE = 1u * readBitFromStream(&bp, in);
@@ -1277,9 +1529,18 @@ static unsigned lodepng_inflatev(ucvector* out,
     if(error) return error;
   }
 
+  if(!final) return 52; /*error: the final block came before the end of the flushed part*/
   return error;
 }
 
+static unsigned lodepng_inflatev(ucvector* out,
+                                 const unsigned char* in, size_t insize,
+                                 const LodePNGDecompressSettings* settings)
+{
+  (void)settings;
+  return inflateBlocks(out, in, insize, 1);
+}
+
 unsigned lodepng_inflate(unsigned char** out, size_t* outsize,
                          const unsigned char* in, size_t insize,
                          const LodePNGDecompressSettings* settings)
@@ -1363,6 +1624,9 @@ static void addLengthDistance(uivector* values, size_t length, size_t distance)
 bytes as input because 3 is the minimum match length for deflate*/
 static const unsigned HASH_NUM_VALUES = 65536;
 static const unsigned HASH_BIT_MASK = 65535; /*HASH_NUM_VALUES - 1, but C90 does not like that as initializer*/
+/*amount of positions at the end of a run found by the run-length path that still get hashed, so that
+later data can match the end of the run followed by what comes after it*/
+#define RUN_HASHED_TAIL 16
 
 typedef struct Hash
 {
@@ -1450,6 +1714,34 @@ static unsigned countZeros(const unsigned char* data, size_t size, size_t pos)
   return (unsigned)(data - start);
 }
 
+/*Marks count positions starting at pos as not hashed: the chains stop when they reach them, and they
+don't claim to start with zeros, so matches can never be extended based on outdated values.*/
+static void hash_invalidate(Hash* hash, size_t pos, size_t count, unsigned windowsize)
+{
+  while(count > 0)
+  {
+    size_t wpos = pos & (windowsize - 1);
+    size_t n = windowsize - wpos, i; /*the amount of positions until the circular buffer wraps around*/
+    if(n > count) n = count;
+    for(i = wpos; i != wpos + n; ++i) hash->val[i] = -1;
+    for(i = wpos; i != wpos + n; ++i) hash->zeros[i] = 0;
+    pos += n;
+    count -= n;
+  }
+}
+
+/*length of the repetition at pos of the bytes distance before it, at most MAX_SUPPORTED_DEFLATE_LENGTH*/
+static unsigned countRepeat(const unsigned char* data, size_t size, size_t pos, unsigned distance)
+{
+  const unsigned char* start = data + pos;
+  const unsigned char* end = start + MAX_SUPPORTED_DEFLATE_LENGTH;
+  if(pos < distance) return 0;
+  if(end > data + size) end = data + size;
+  data = start;
+  while(data != end && *data == *(data - distance)) ++data;
+  return (unsigned)(data - start);
+}
+
 /*wpos = pos & (windowsize - 1)*/
 static void updateHashChain(Hash* hash, size_t wpos, unsigned hashval, unsigned short numzeros)
 {
@@ -1493,6 +1785,7 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
   unsigned prev_offset;
   const unsigned char *lastptr, *foreptr, *backptr;
   unsigned hashpos;
+  size_t nummatches = 0, numchainsteps = 0; /*for the counters*/
 
   if(windowsize == 0 || windowsize > 32768) return 60; /*error: windowsize smaller/larger than allowed*/
   if((windowsize & (windowsize - 1)) != 0) return 90; /*error: must be power of two*/
@@ -1518,6 +1811,54 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
 
     updateHashChain(hash, wpos, hashval, numzeros);
 
+    /*Runs of one byte or one RGBA pixel, such as flat areas of an image, are encoded directly as a match at
+    distance 1 or 4 without searching the chains. Only the last RUN_HASHED_TAIL positions of the run are
+    hashed, the others are just marked as invalid for the chains.*/
+    if(!lazy)
+    {
+      unsigned rundistance = 1;
+      unsigned runlength = countRepeat(in, insize, pos, 1);
+      if(runlength < nicematch && windowsize >= 4)
+      {
+        unsigned runlength4 = countRepeat(in, insize, pos, 4);
+        if(runlength4 > runlength)
+        {
+          runlength = runlength4;
+          rundistance = 4;
+        }
+      }
+      if(runlength >= nicematch && runlength >= minmatch && runlength >= 3)
+      {
+        addLengthDistance(out, runlength, rundistance);
+        ++nummatches;
+        numzeros = 0;
+        i = 1;
+        if(runlength > RUN_HASHED_TAIL + 1)
+        {
+          hash_invalidate(hash, pos + 1, runlength - RUN_HASHED_TAIL - 1, windowsize);
+          pos += runlength - RUN_HASHED_TAIL - 1;
+          i = runlength - RUN_HASHED_TAIL;
+        }
+        for(; i < runlength; ++i)
+        {
+          ++pos;
+          wpos = pos & (windowsize - 1);
+          hashval = getHash(in, insize, pos);
+          if(usezeros && hashval == 0)
+          {
+            if(numzeros == 0) numzeros = countZeros(in, insize, pos);
+            else if(pos + numzeros > insize || in[pos + numzeros - 1] != 0) --numzeros;
+          }
+          else
+          {
+            numzeros = 0;
+          }
+          updateHashChain(hash, wpos, hashval, numzeros);
+        }
+        continue;
+      }
+    }
+
     /*the length and offset found for the current position*/
     length = 0;
     offset = 0;
@@ -1581,6 +1922,7 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
         if(hash->val[hashpos] != (int)hashval) break;
       }
     }
+    numchainsteps += chainlength;
 
     if(lazymatching)
     {
@@ -1626,6 +1968,7 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
     else
     {
       addLengthDistance(out, length, offset);
+      ++nummatches;
       for(i = 1; i < length; ++i)
       {
         ++pos;
@@ -1645,12 +1988,14 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
     }
   } /*end of the loop through each character of input*/
 
+  LODEPNG_COUNT(METRIC_LZ77_MATCHES, nummatches);
+  LODEPNG_COUNT(METRIC_LZ77_CHAIN_STEPS, numchainsteps);
   return error;
 }
 
 /* /////////////////////////////////////////////////////////////////////////// */
 
-static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize)
+static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize, unsigned final)
 {
   /*non compressed deflate block data: 1 bit BFINAL,2 bits BTYPE,(5 bits): it jumps to start of next byte,
   2 bytes LEN, 2 bytes NLEN, LEN bytes literal DATA*/
@@ -1662,7 +2007,7 @@ static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, s
     unsigned BFINAL, BTYPE, LEN, NLEN;
     unsigned char firstbyte;
 
-    BFINAL = (i == numdeflateblocks - 1);
+    BFINAL = final && (i == numdeflateblocks - 1);
     BTYPE = 0;
 
     firstbyte = (unsigned char)(BFINAL + ((BTYPE & 1) << 1) + ((BTYPE & 2) << 1));
@@ -1689,14 +2034,15 @@ static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, s
 
 /*
 write the lz77-encoded data, which has lit, len and dist codes, to compressed stream using huffman trees.
+lstart, lend: the range of lz77_encoded to write, starting and ending at symbol boundaries.
 tree_ll: the tree for lit and len codes.
 tree_d: the tree for distance codes.
 */
-static void writeLZ77data(size_t* bp, ucvector* out, const uivector* lz77_encoded,
+static void writeLZ77data(size_t* bp, ucvector* out, const uivector* lz77_encoded, size_t lstart, size_t lend,
                           const HuffmanTree* tree_ll, const HuffmanTree* tree_d)
 {
   size_t i = 0;
-  for(i = 0; i != lz77_encoded->size; ++i)
+  for(i = lstart; i != lend; ++i)
   {
     unsigned val = lz77_encoded->data[i];
     addHuffmanSymbol(bp, out, HuffmanTree_getCode(tree_ll, val), HuffmanTree_getLength(tree_ll, val));
@@ -1720,10 +2066,65 @@ static void writeLZ77data(size_t* bp, ucvector* out, const uivector* lz77_encode
   }
 }
 
-/*Deflate for a block of type "dynamic", that is, with freely, optimally, created huffman trees*/
-static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
-                               const unsigned char* data, size_t datapos, size_t dataend,
-                               const LodePNGCompressSettings* settings, unsigned final)
+/*
+run-length compress the code lengths bitlen into out by using repeat codes 16 (copy length 3-6 times),
+17 (3-10 zeroes), 18 (11-138 zeroes). A repeat code is followed by its amount of repetitions, so out
+must have room for 2 * num values. Returns the amount of values written to out.
+*/
+static size_t encodeCodeLengthRuns(unsigned* out, const unsigned* bitlen, size_t num)
+{
+  size_t i, size = 0;
+  for(i = 0; i != num; ++i)
+  {
+    unsigned j = 0; /*amount of repititions*/
+    while(i + j + 1 < num && bitlen[i + j + 1] == bitlen[i]) ++j;
+
+    if(bitlen[i] == 0 && j >= 2) /*repeat code for zeroes*/
+    {
+      ++j; /*include the first zero*/
+      if(j <= 10) /*repeat code 17 supports max 10 zeroes*/
+      {
+        out[size++] = 17;
+        out[size++] = j - 3;
+      }
+      else /*repeat code 18 supports max 138 zeroes*/
+      {
+        if(j > 138) j = 138;
+        out[size++] = 18;
+        out[size++] = j - 11;
+      }
+      i += (j - 1);
+    }
+    else if(j >= 3) /*repeat code for value other than zero*/
+    {
+      size_t k;
+      unsigned num6 = j / 6, rest = j % 6;
+      out[size++] = bitlen[i];
+      for(k = 0; k < num6; ++k)
+      {
+        out[size++] = 16;
+        out[size++] = 6 - 3;
+      }
+      if(rest >= 3)
+      {
+        out[size++] = 16;
+        out[size++] = rest - 3;
+      }
+      else j -= rest;
+      i += j;
+    }
+    else /*too short to benefit from repeat code*/
+    {
+      out[size++] = bitlen[i];
+    }
+  }
+  return size;
+}
+
+/*Writes the lz77 symbols lz77_encoded[lstart, lend) as one block of type "dynamic", that is, with freely,
+optimally, created huffman trees*/
+static unsigned writeDynamicBlock(ucvector* out, size_t* bp, const uivector* lz77_encoded,
+                                  size_t lstart, size_t lend, unsigned final)
 {
   unsigned error = 0;
 
@@ -1738,8 +2139,6 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
   the code length code lengths ("clcl").
   */
 
-  /*The lz77 encoded data, represented with integers since there will also be length and distance codes in it*/
-  uivector lz77_encoded;
   HuffmanTree tree_ll; /*tree for lit,len values*/
   HuffmanTree tree_d; /*tree for distance codes*/
   HuffmanTree tree_cl; /*tree for encoding the code lengths representing tree_ll and tree_d*/
@@ -1752,7 +2151,6 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
   (these are written as is in the file, it would be crazy to compress these using yet another huffman
   tree that needs to be represented by yet another set of code lengths)*/
   uivector bitlen_cl;
-  size_t datasize = dataend - datapos;
 
   /*
   Due to the huffman compression of huffman tree representations ("two levels"), there are some anologies:
@@ -1765,7 +2163,6 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
   size_t numcodes_ll, numcodes_d, i;
   unsigned HLIT, HDIST, HCLEN;
 
-  uivector_init(&lz77_encoded);
   HuffmanTree_init(&tree_ll);
   HuffmanTree_init(&tree_d);
   HuffmanTree_init(&tree_cl);
@@ -1780,29 +2177,17 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
   allow breaking out of it to the cleanup phase on error conditions.*/
   while(!error)
   {
-    if(settings->use_lz77)
-    {
-      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                         settings->minmatch, settings->nicematch, settings->lazymatching);
-      if(error) break;
-    }
-    else
-    {
-      if(!uivector_resize(&lz77_encoded, datasize)) ERROR_BREAK(83 /*alloc fail*/);
-      for(i = datapos; i < dataend; ++i) lz77_encoded.data[i - datapos] = data[i]; /*no LZ77, but still will be Huffman compressed*/
-    }
-
     if(!uivector_resizev(&frequencies_ll, 286, 0)) ERROR_BREAK(83 /*alloc fail*/);
     if(!uivector_resizev(&frequencies_d, 30, 0)) ERROR_BREAK(83 /*alloc fail*/);
 
     /*Count the frequencies of lit, len and dist codes*/
-    for(i = 0; i != lz77_encoded.size; ++i)
+    for(i = lstart; i != lend; ++i)
     {
-      unsigned symbol = lz77_encoded.data[i];
+      unsigned symbol = lz77_encoded->data[i];
       ++frequencies_ll.data[symbol];
       if(symbol > 256)
       {
-        unsigned dist = lz77_encoded.data[i + 2];
+        unsigned dist = lz77_encoded->data[i + 2];
         ++frequencies_d.data[dist];
         i += 3;
       }
@@ -1822,52 +2207,9 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
     for(i = 0; i != numcodes_ll; ++i) uivector_push_back(&bitlen_lld, HuffmanTree_getLength(&tree_ll, (unsigned)i));
     for(i = 0; i != numcodes_d; ++i) uivector_push_back(&bitlen_lld, HuffmanTree_getLength(&tree_d, (unsigned)i));
 
-    /*run-length compress bitlen_ldd into bitlen_lld_e by using repeat codes 16 (copy length 3-6 times),
-    17 (3-10 zeroes), 18 (11-138 zeroes)*/
-    for(i = 0; i != (unsigned)bitlen_lld.size; ++i)
-    {
-      unsigned j = 0; /*amount of repititions*/
-      while(i + j + 1 < (unsigned)bitlen_lld.size && bitlen_lld.data[i + j + 1] == bitlen_lld.data[i]) ++j;
-
-      if(bitlen_lld.data[i] == 0 && j >= 2) /*repeat code for zeroes*/
-      {
-        ++j; /*include the first zero*/
-        if(j <= 10) /*repeat code 17 supports max 10 zeroes*/
-        {
-          uivector_push_back(&bitlen_lld_e, 17);
-          uivector_push_back(&bitlen_lld_e, j - 3);
-        }
-        else /*repeat code 18 supports max 138 zeroes*/
-        {
-          if(j > 138) j = 138;
-          uivector_push_back(&bitlen_lld_e, 18);
-          uivector_push_back(&bitlen_lld_e, j - 11);
-        }
-        i += (j - 1);
-      }
-      else if(j >= 3) /*repeat code for value other than zero*/
-      {
-        size_t k;
-        unsigned num = j / 6, rest = j % 6;
-        uivector_push_back(&bitlen_lld_e, bitlen_lld.data[i]);
-        for(k = 0; k < num; ++k)
-        {
-          uivector_push_back(&bitlen_lld_e, 16);
-          uivector_push_back(&bitlen_lld_e, 6 - 3);
-        }
-        if(rest >= 3)
-        {
-          uivector_push_back(&bitlen_lld_e, 16);
-          uivector_push_back(&bitlen_lld_e, rest - 3);
-        }
-        else j -= rest;
-        i += j;
-      }
-      else /*too short to benefit from repeat code*/
-      {
-        uivector_push_back(&bitlen_lld_e, bitlen_lld.data[i]);
-      }
-    }
+    /*run-length compress bitlen_ldd into bitlen_lld_e*/
+    if(!uivector_resize(&bitlen_lld_e, 2 * bitlen_lld.size)) ERROR_BREAK(83 /*alloc fail*/);
+    bitlen_lld_e.size = encodeCodeLengthRuns(bitlen_lld_e.data, bitlen_lld.data, bitlen_lld.size);
 
     /*generate tree_cl, the huffmantree of huffmantrees*/
 
@@ -1941,7 +2283,7 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
     }
 
     /*write the compressed data symbols*/
-    writeLZ77data(bp, out, &lz77_encoded, &tree_ll, &tree_d);
+    writeLZ77data(bp, out, lz77_encoded, lstart, lend, &tree_ll, &tree_d);
     /*error: the length of the end code 256 must be larger than 0*/
     if(HuffmanTree_getLength(&tree_ll, 256) == 0) ERROR_BREAK(64);
 
@@ -1952,7 +2294,6 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
   }
 
   /*cleanup*/
-  uivector_cleanup(&lz77_encoded);
   HuffmanTree_cleanup(&tree_ll);
   HuffmanTree_cleanup(&tree_d);
   HuffmanTree_cleanup(&tree_cl);
@@ -1966,6 +2307,250 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
   return error;
 }
 
+/*
+Block splitting: the lz77 symbols of a range of the input are cut in segments of SPLIT_SEGMENT_SYMBOLS
+symbols, and blocks are made of consecutive segments. A block is split in two where that gives the smallest
+estimated size, as long as the two halves are estimated smaller than the whole, so the huffman trees can
+adapt where the statistics of the data change, for example between flat and noisy parts of an image.
+*/
+
+/*maximum amount of input bytes whose lz77 symbols are split at once*/
+#define SPLIT_MAX_INPUT 1048576
+/*amount of lz77 symbols per segment, the unit in which split points are chosen*/
+#define SPLIT_SEGMENT_SYMBOLS 1024
+/*amount of split points that findBlockSplit tries per narrowing step*/
+#define SPLIT_SEARCH_POINTS 9
+/*amount of lit/len and dist codes in the histogram of a segment*/
+#define SPLIT_HISTOGRAM_SIZE (286 + 30)
+
+/*
+Estimated size in bits of a dynamic block with the given frequencies, trees included. The extra bits of
+lengths and distances are left out, since they don't depend on how the data is split into blocks.
+*/
+static size_t dynamicBlockCost(const unsigned* frequencies_ll, const unsigned* frequencies_d)
+{
+  unsigned bitlen_lld[286 + 30];
+  unsigned bitlen_lld_e[2 * (286 + 30)];
+  unsigned frequencies_cl[NUM_CODE_LENGTH_CODES];
+  unsigned bitlen_cl[NUM_CODE_LENGTH_CODES];
+  size_t numcodes_ll = 286, numcodes_d = 30, numruns, i;
+  size_t cost = 3 + 5 + 5 + 4; /*BFINAL, BTYPE, HLIT, HDIST and HCLEN*/
+  unsigned hclen = NUM_CODE_LENGTH_CODES;
+
+  /*trimmed and limited the same way as in writeDynamicBlock. These sizes need no allocation, so can't fail*/
+  while(numcodes_ll > 257 && !frequencies_ll[numcodes_ll - 1]) --numcodes_ll;
+  while(numcodes_d > 2 && !frequencies_d[numcodes_d - 1]) --numcodes_d;
+  lodepng_huffman_code_lengths(bitlen_lld, frequencies_ll, numcodes_ll, 15);
+  lodepng_huffman_code_lengths(bitlen_lld + numcodes_ll, frequencies_d, numcodes_d, 15);
+  for(i = 0; i != numcodes_ll; ++i) cost += (size_t)frequencies_ll[i] * bitlen_lld[i];
+  for(i = 0; i != numcodes_d; ++i) cost += (size_t)frequencies_d[i] * bitlen_lld[numcodes_ll + i];
+
+  numruns = encodeCodeLengthRuns(bitlen_lld_e, bitlen_lld, numcodes_ll + numcodes_d);
+  for(i = 0; i != NUM_CODE_LENGTH_CODES; ++i) frequencies_cl[i] = 0;
+  for(i = 0; i != numruns; ++i)
+  {
+    unsigned symbol = bitlen_lld_e[i];
+    ++frequencies_cl[symbol];
+    if(symbol >= 16)
+    {
+      cost += symbol == 16 ? 2 : (symbol == 17 ? 3 : 7);
+      ++i;
+    }
+  }
+  lodepng_huffman_code_lengths(bitlen_cl, frequencies_cl, NUM_CODE_LENGTH_CODES, 7);
+  for(i = 0; i != NUM_CODE_LENGTH_CODES; ++i) cost += (size_t)frequencies_cl[i] * bitlen_cl[i];
+  while(hclen > 4 && !bitlen_cl[CLCL_ORDER[hclen - 1]]) --hclen;
+  return cost + hclen * 3;
+}
+
+/*Estimated size of a block made of segments [a, b), histograms holds the sums of the histograms of all
+segments before each segment*/
+static size_t splitBlockCost(const unsigned* histograms, size_t a, size_t b)
+{
+  unsigned frequencies[SPLIT_HISTOGRAM_SIZE];
+  const unsigned* ha = &histograms[a * SPLIT_HISTOGRAM_SIZE];
+  const unsigned* hb = &histograms[b * SPLIT_HISTOGRAM_SIZE];
+  size_t i;
+  for(i = 0; i != SPLIT_HISTOGRAM_SIZE; ++i) frequencies[i] = hb[i] - ha[i];
+  frequencies[256] = 1; /*the end code*/
+  return dynamicBlockCost(frequencies, frequencies + 286);
+}
+
+/*
+Finds the split point c in (a, b) with the smallest estimated size of [a, c) and [c, b) together,
+and outputs that size in cost. Like zopfli, this evaluates a few evenly spaced points and then
+narrows the search around the best one, which assumes the cost doesn't have many local minima.
+*/
+static size_t findBlockSplit(size_t* cost, const unsigned* histograms, size_t a, size_t b)
+{
+  size_t lo = a + 1, hi = b; /*the candidates are in [lo, hi)*/
+  size_t best = lo;
+  *cost = (size_t)(-1);
+  for(;;)
+  {
+    size_t points[SPLIT_SEARCH_POINTS];
+    size_t num, i, besti = 0;
+    if(hi - lo <= SPLIT_SEARCH_POINTS)
+    {
+      num = hi - lo;
+      for(i = 0; i != num; ++i) points[i] = lo + i;
+    }
+    else
+    {
+      num = SPLIT_SEARCH_POINTS;
+      for(i = 0; i != num; ++i) points[i] = lo + (i + 1) * (hi - lo) / (SPLIT_SEARCH_POINTS + 1);
+    }
+    for(i = 0; i != num; ++i)
+    {
+      size_t c = points[i];
+      size_t splitcost = splitBlockCost(histograms, a, c) + splitBlockCost(histograms, c, b);
+      if(splitcost < *cost)
+      {
+        *cost = splitcost;
+        best = c;
+        besti = i;
+      }
+    }
+    if(num != SPLIT_SEARCH_POINTS) break; /*all remaining candidates were tried*/
+    /*continue between the neighbours of the best point*/
+    if(besti > 0) lo = points[besti - 1] + 1;
+    if(besti + 1 < num) hi = points[besti + 1];
+    if(hi - lo <= 1) break;
+  }
+  return best;
+}
+
+/*Writes the lz77 symbols as one or more dynamic blocks, split where that is estimated to be smaller*/
+static unsigned writeDynamicBlocks(ucvector* out, size_t* bp, const uivector* lz77_encoded, unsigned final)
+{
+  unsigned error = 0;
+  uivector starts; /*the lz77 index of the start of every segment, followed by the end*/
+  uivector histograms; /*per segment, the sum of the histograms of all segments before it*/
+  uivector stack; /*pairs of segment ranges [a, b) that still have to be written, the last pair first*/
+  size_t numsegments, i, s;
+
+  uivector_init(&starts);
+  uivector_init(&histograms);
+  uivector_init(&stack);
+
+  /*This while loop never loops due to a break at the end, it is here to
+  allow breaking out of it to the cleanup phase on error conditions.*/
+  while(!error)
+  {
+    unsigned count = 0;
+    if(!uivector_push_back(&starts, 0)) ERROR_BREAK(83 /*alloc fail*/);
+    for(i = 0; i < lz77_encoded->size;)
+    {
+      i += lz77_encoded->data[i] > 256 ? 4 : 1; /*a length code is followed by 3 more values*/
+      if(++count == SPLIT_SEGMENT_SYMBOLS && i < lz77_encoded->size)
+      {
+        if(!uivector_push_back(&starts, (unsigned)i)) ERROR_BREAK(83 /*alloc fail*/);
+        count = 0;
+      }
+    }
+    if(error) break;
+    if(!uivector_push_back(&starts, (unsigned)lz77_encoded->size)) ERROR_BREAK(83 /*alloc fail*/);
+    numsegments = starts.size - 1;
+
+    if(numsegments < 2)
+    {
+      error = writeDynamicBlock(out, bp, lz77_encoded, 0, lz77_encoded->size, final);
+      break;
+    }
+
+    if(!uivector_resizev(&histograms, (numsegments + 1) * SPLIT_HISTOGRAM_SIZE, 0)) ERROR_BREAK(83 /*alloc fail*/);
+    for(s = 0; s != numsegments; ++s)
+    {
+      unsigned* h = &histograms.data[(s + 1) * SPLIT_HISTOGRAM_SIZE];
+      memcpy(h, h - SPLIT_HISTOGRAM_SIZE, SPLIT_HISTOGRAM_SIZE * sizeof(unsigned));
+      for(i = starts.data[s]; i != starts.data[s + 1]; ++i)
+      {
+        unsigned symbol = lz77_encoded->data[i];
+        ++h[symbol];
+        if(symbol > 256)
+        {
+          ++h[286 + lz77_encoded->data[i + 2]];
+          i += 3;
+        }
+      }
+    }
+
+    if(!uivector_push_back(&stack, 0) || !uivector_push_back(&stack, (unsigned)numsegments))
+    {
+      ERROR_BREAK(83 /*alloc fail*/);
+    }
+    while(stack.size)
+    {
+      size_t b = stack.data[stack.size - 1];
+      size_t a = stack.data[stack.size - 2];
+      stack.size -= 2;
+      if(b - a >= 2)
+      {
+        size_t splitcost;
+        size_t c = findBlockSplit(&splitcost, histograms.data, a, b);
+        if(splitcost < splitBlockCost(histograms.data, a, b))
+        {
+          /*the pairs are stored as (a, b) so [a, c) is popped first*/
+          if(!uivector_push_back(&stack, (unsigned)c) || !uivector_push_back(&stack, (unsigned)b)
+             || !uivector_push_back(&stack, (unsigned)a) || !uivector_push_back(&stack, (unsigned)c))
+          {
+            ERROR_BREAK(83 /*alloc fail*/);
+          }
+          continue;
+        }
+      }
+      error = writeDynamicBlock(out, bp, lz77_encoded, starts.data[a], starts.data[b],
+                                final && b == numsegments);
+      if(error) break;
+    }
+
+    break; /*end of error-while*/
+  }
+
+  uivector_cleanup(&starts);
+  uivector_cleanup(&histograms);
+  uivector_cleanup(&stack);
+
+  return error;
+}
+
+/*Deflate for data in blocks of type "dynamic", with one block or, if the settings enable block
+splitting, as many as the data is estimated to compress best with*/
+static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
+                               const unsigned char* data, size_t datapos, size_t dataend,
+                               const LodePNGCompressSettings* settings, unsigned final)
+{
+  unsigned error = 0;
+  /*The lz77 encoded data, represented with integers since there will also be length and distance codes in it*/
+  uivector lz77_encoded;
+  size_t datasize = dataend - datapos;
+  size_t i;
+
+  uivector_init(&lz77_encoded);
+
+  if(settings->use_lz77)
+  {
+    error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
+                       settings->minmatch, settings->nicematch, settings->lazymatching);
+  }
+  else
+  {
+    if(!uivector_resize(&lz77_encoded, datasize)) error = 83; /*alloc fail*/
+    /*no LZ77, but still will be Huffman compressed*/
+    else for(i = datapos; i < dataend; ++i) lz77_encoded.data[i - datapos] = data[i];
+  }
+
+  if(!error)
+  {
+    if(settings->blocksplitting) error = writeDynamicBlocks(out, bp, &lz77_encoded, final);
+    else error = writeDynamicBlock(out, bp, &lz77_encoded, 0, lz77_encoded.size, final);
+  }
+
+  uivector_cleanup(&lz77_encoded);
+
+  return error;
+}
+
 static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
                              const unsigned char* data,
                              size_t datapos, size_t dataend,
@@ -1994,7 +2579,7 @@ static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
     uivector_init(&lz77_encoded);
     error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
                        settings->minmatch, settings->nicematch, settings->lazymatching);
-    if(!error) writeLZ77data(bp, out, &lz77_encoded, &tree_ll, &tree_d);
+    if(!error) writeLZ77data(bp, out, &lz77_encoded, 0, lz77_encoded.size, &tree_ll, &tree_d);
     uivector_cleanup(&lz77_encoded);
   }
   else /*no LZ77, but still will be Huffman compressed*/
@@ -2014,8 +2599,13 @@ static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
   return error;
 }
 
+/*
+Deflates in, appending to out, which must end at a byte boundary. If final is 0, the deflate stream goes on
+after this: the last block is not final and is followed by an empty stored block, so out ends at a byte
+boundary again, and the next call starts with an empty window. zlib calls this a full flush.
+*/
 static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
-                                 const LodePNGCompressSettings* settings)
+                                 const LodePNGCompressSettings* settings, unsigned final)
 {
   unsigned error = 0;
   size_t i, blocksize, numdeflateblocks;
@@ -2023,8 +2613,13 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
   Hash hash;
 
   if(settings->btype > 2) return 61;
-  else if(settings->btype == 0) return deflateNoCompression(out, in, insize);
+  else if(settings->btype == 0) return deflateNoCompression(out, in, insize, final);
   else if(settings->btype == 1) blocksize = insize;
+  else if(settings->blocksplitting)
+  {
+    /*the blocks are chosen by deflateDynamic, this only bounds the memory used for the lz77 symbols*/
+    blocksize = SPLIT_MAX_INPUT;
+  }
   else /*if(settings->btype == 2)*/
   {
     /*on PNGs, deflate blocks of 65-262k seem to give most dense encoding*/
@@ -2041,13 +2636,25 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
 
   for(i = 0; i != numdeflateblocks && !error; ++i)
   {
-    unsigned final = (i == numdeflateblocks - 1);
+    unsigned lastblock = final && (i == numdeflateblocks - 1);
     size_t start = i * blocksize;
     size_t end = start + blocksize;
     if(end > insize) end = insize;
 
-    if(settings->btype == 1) error = deflateFixed(out, &bp, &hash, in, start, end, settings, final);
-    else if(settings->btype == 2) error = deflateDynamic(out, &bp, &hash, in, start, end, settings, final);
+    if(settings->btype == 1) error = deflateFixed(out, &bp, &hash, in, start, end, settings, lastblock);
+    else if(settings->btype == 2) error = deflateDynamic(out, &bp, &hash, in, start, end, settings, lastblock);
+  }
+
+  if(!error && !final)
+  {
+    /*empty stored block: BFINAL 0, BTYPE 00, padding up to the byte boundary, LEN 0 and NLEN 65535*/
+    addBitToStream(&bp, out, 0);
+    addBitToStream(&bp, out, 0);
+    addBitToStream(&bp, out, 0);
+    ucvector_push_back(out, 0);
+    ucvector_push_back(out, 0);
+    ucvector_push_back(out, 255);
+    ucvector_push_back(out, 255);
   }
 
   hash_cleanup(&hash);
@@ -2062,7 +2669,7 @@ unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
   unsigned error;
   ucvector v;
   ucvector_init_buffer(&v, *out, *outsize);
-  error = lodepng_deflatev(&v, in, insize, settings);
+  error = lodepng_deflatev(&v, in, insize, settings, 1);
   *out = v.data;
   *outsize = v.size;
   return error;
@@ -2117,6 +2724,22 @@ static unsigned adler32(const unsigned char* data, unsigned len)
   return update_adler32(1L, data, len);
 }
 
+/*Return the adler32 of two buffers one after the other, given their adler32 values and the length of the second.
+The adler32 of an empty buffer is 1.*/
+static unsigned adler32_combine(unsigned adler1, unsigned adler2, size_t len2)
+{
+  unsigned rem = (unsigned)(len2 % 65521);
+  unsigned s1 = adler1 & 0xffff;
+  unsigned s2 = (rem * s1) % 65521; /*at most 65520 * 65520, which fits in 32 bits*/
+  s1 += (adler2 & 0xffff) + 65521 - 1;
+  s2 += ((adler1 >> 16) & 0xffff) + ((adler2 >> 16) & 0xffff) + 65521 - rem;
+  if(s1 >= 65521) s1 -= 65521;
+  if(s1 >= 65521) s1 -= 65521;
+  if(s2 >= 65521 * 2) s2 -= 65521 * 2;
+  if(s2 >= 65521) s2 -= 65521;
+  return (s2 << 16) | s1;
+}
+
 /* ////////////////////////////////////////////////////////////////////////// */
 /* / Zlib                                                                   / */
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -2185,6 +2808,20 @@ static unsigned zlib_decompress(unsigned char** out, size_t* outsize, const unsi
 
 #ifdef LODEPNG_COMPILE_ENCODER
 
+/*zlib data: 1 byte CMF (CM+CINFO), 1 byte FLG, deflate data, 4 byte ADLER32 checksum of the Decompressed data*/
+static void addZlibHeader(ucvector* out)
+{
+  unsigned CMF = 120; /*0b01111000: CM 8, CINFO 7. With CINFO 7, any window size up to 32768 can be used.*/
+  unsigned FLEVEL = 0;
+  unsigned FDICT = 0;
+  unsigned CMFFLG = 256 * CMF + FDICT * 32 + FLEVEL * 64;
+  unsigned FCHECK = 31 - CMFFLG % 31;
+  CMFFLG += FCHECK;
+
+  ucvector_push_back(out, (unsigned char)(CMFFLG >> 8));
+  ucvector_push_back(out, (unsigned char)(CMFFLG & 255));
+}
+
 unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
                                size_t insize, const LodePNGCompressSettings* settings)
 {
@@ -2196,19 +2833,10 @@ unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsig
   unsigned char* deflatedata = 0;
   size_t deflatesize = 0;
 
-  /*zlib data: 1 byte CMF (CM+CINFO), 1 byte FLG, deflate data, 4 byte ADLER32 checksum of the Decompressed data*/
-  unsigned CMF = 120; /*0b01111000: CM 8, CINFO 7. With CINFO 7, any window size up to 32768 can be used.*/
-  unsigned FLEVEL = 0;
-  unsigned FDICT = 0;
-  unsigned CMFFLG = 256 * CMF + FDICT * 32 + FLEVEL * 64;
-  unsigned FCHECK = 31 - CMFFLG % 31;
-  CMFFLG += FCHECK;
-
   /*ucvector-controlled version of the output buffer, for dynamic array*/
   ucvector_init_buffer(&outv, *out, *outsize);
 
-  ucvector_push_back(&outv, (unsigned char)(CMFFLG >> 8));
-  ucvector_push_back(&outv, (unsigned char)(CMFFLG & 255));
+  addZlibHeader(&outv);
 
   error = deflate(&deflatedata, &deflatesize, in, insize, settings);
 
@@ -2279,13 +2907,14 @@ void lodepng_compress_settings_init(LodePNGCompressSettings* settings)
   settings->minmatch = 3;
   settings->nicematch = 128;
   settings->lazymatching = 1;
+  settings->blocksplitting = 1;
 
   settings->custom_zlib = 0;
   settings->custom_deflate = 0;
   settings->custom_context = 0;
 }
 
-const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0};
+const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 1, 0, 0, 0};
 
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -2991,49 +3620,51 @@ static void addColorBits(unsigned char* out, size_t index, unsigned bits, unsign
 
 typedef struct ColorTree ColorTree;
 
+/*amount of slots in a ColorTree. Must be a power of two, and at least twice the maximum
+amount of colors ever stored in it (257, by lodepng_get_color_profile) to keep probe chains short*/
+#define COLOR_TREE_SIZE 1024
+
 /*
-One node of a color tree
 This is the data structure used to count the number of unique colors and to get a palette
-index for a color. It's like an octree, but because the alpha channel is used too, each
-node has 16 instead of 8 children.
+index for a color. It's a flat open addressing hash table of RGBA colors packed into 32-bit
+keys with linear probing. It has a fixed size, so it needs no allocations at all, and a
+lookup is a hash plus a few comparisons in adjacent memory.
 */
 struct ColorTree
 {
-  ColorTree* children[16]; /*up to 16 pointers to ColorTree of next level*/
-  int index; /*the payload. Only has a meaningful value if this is in the last level*/
+  unsigned keys[COLOR_TREE_SIZE]; /*the packed RGBA colors*/
+  int index[COLOR_TREE_SIZE]; /*the payload, -1 for an empty slot*/
 };
 
 static void color_tree_init(ColorTree* tree)
 {
   int i;
-  for(i = 0; i != 16; ++i) tree->children[i] = 0;
-  tree->index = -1;
+  for(i = 0; i != COLOR_TREE_SIZE; ++i) tree->index[i] = -1;
 }
 
 static void color_tree_cleanup(ColorTree* tree)
 {
-  int i;
-  for(i = 0; i != 16; ++i)
-  {
-    if(tree->children[i])
-    {
-      color_tree_cleanup(tree->children[i]);
-      lodepng_free(tree->children[i]);
-    }
-  }
+  (void)tree; /*nothing to free, the table is not dynamically allocated*/
+}
+
+static unsigned color_tree_key(unsigned char r, unsigned char g, unsigned char b, unsigned char a)
+{
+  return ((unsigned)r << 24u) | ((unsigned)g << 16u) | ((unsigned)b << 8u) | (unsigned)a;
+}
+
+/*returns the slot where the key is, or the empty slot where it should be inserted*/
+static unsigned color_tree_slot(const ColorTree* tree, unsigned key)
+{
+  /*multiplicative hashing, the top bits of the product are the best mixed ones*/
+  unsigned slot = ((key * 2654435761u) & 0xffffffffu) >> 22u;
+  while(tree->index[slot] >= 0 && tree->keys[slot] != key) slot = (slot + 1u) & (COLOR_TREE_SIZE - 1u);
+  return slot;
 }
 
 /*returns -1 if color not present, its index otherwise*/
 static int color_tree_get(ColorTree* tree, unsigned char r, unsigned char g, unsigned char b, unsigned char a)
 {
-  int bit = 0;
-  for(bit = 0; bit < 8; ++bit)
-  {
-    int i = 8 * ((r >> bit) & 1) + 4 * ((g >> bit) & 1) + 2 * ((b >> bit) & 1) + 1 * ((a >> bit) & 1);
-    if(!tree->children[i]) return -1;
-    else tree = tree->children[i];
-  }
-  return tree ? tree->index : -1;
+  return tree->index[color_tree_slot(tree, color_tree_key(r, g, b, a))];
 }
 
 #ifdef LODEPNG_COMPILE_ENCODER
@@ -3043,23 +3674,15 @@ static int color_tree_has(ColorTree* tree, unsigned char r, unsigned char g, uns
 }
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
-/*color is not allowed to already exist.
+/*if the color already exists, its index is replaced (a palette with duplicate colors maps them to the last one).
 Index should be >= 0 (it's signed to be compatible with using -1 for "doesn't exist")*/
 static void color_tree_add(ColorTree* tree,
                            unsigned char r, unsigned char g, unsigned char b, unsigned char a, unsigned index)
 {
-  int bit;
-  for(bit = 0; bit < 8; ++bit)
-  {
-    int i = 8 * ((r >> bit) & 1) + 4 * ((g >> bit) & 1) + 2 * ((b >> bit) & 1) + 1 * ((a >> bit) & 1);
-    if(!tree->children[i])
-    {
-      tree->children[i] = (ColorTree*)lodepng_malloc(sizeof(ColorTree));
-      color_tree_init(tree->children[i]);
-    }
-    tree = tree->children[i];
-  }
-  tree->index = (int)index;
+  unsigned key = color_tree_key(r, g, b, a);
+  unsigned slot = color_tree_slot(tree, key);
+  tree->keys[slot] = key;
+  tree->index[slot] = (int)index;
 }
 
 /*put a pixel, given its RGBA color, into image of any color type*/
@@ -3456,12 +4079,138 @@ static void getPixelColorRGBA16(unsigned short* r, unsigned short* g, unsigned s
   }
 }
 
+/*
+Specialized conversions for common pairs of color types, giving the same result as the generic path of
+lodepng_convert. They are simple loops with a fixed stride and no per-pixel branches, so the compiler
+can vectorize them.
+*/
+typedef void (*ColorConvertFunc)(unsigned char* out, const unsigned char* in,
+                                 const LodePNGColorMode* mode_in, size_t numpixels);
+
+static void convertRGBA8ToRGB8(unsigned char* out, const unsigned char* in,
+                               const LodePNGColorMode* mode_in, size_t numpixels)
+{
+  size_t i;
+  (void)mode_in;
+  for(i = 0; i != numpixels; ++i)
+  {
+    out[i * 3 + 0] = in[i * 4 + 0];
+    out[i * 3 + 1] = in[i * 4 + 1];
+    out[i * 3 + 2] = in[i * 4 + 2];
+  }
+}
+
+/*16-bit to 8-bit keeps the most significant byte*/
+static void convertRGBA16ToRGBA8(unsigned char* out, const unsigned char* in,
+                                 const LodePNGColorMode* mode_in, size_t numpixels)
+{
+  size_t i;
+  (void)mode_in;
+  for(i = 0; i != numpixels; ++i)
+  {
+    out[i * 4 + 0] = in[i * 8 + 0];
+    out[i * 4 + 1] = in[i * 8 + 2];
+    out[i * 4 + 2] = in[i * 8 + 4];
+    out[i * 4 + 3] = in[i * 8 + 6];
+  }
+}
+
+/*grey is the red channel, see rgba8ToPixel*/
+static void convertRGBA8ToGrey8(unsigned char* out, const unsigned char* in,
+                                const LodePNGColorMode* mode_in, size_t numpixels)
+{
+  size_t i;
+  (void)mode_in;
+  for(i = 0; i != numpixels; ++i) out[i] = in[i * 4];
+}
+
+/*Fills a full 256 entry RGBA table, with black for indices that are out of range, like getPixelColorsRGBA8*/
+static void getPaletteTable(unsigned char table[1024], const LodePNGColorMode* mode)
+{
+  size_t i;
+  for(i = 0; i != 256; ++i)
+  {
+    if(i < mode->palettesize)
+    {
+      table[i * 4 + 0] = mode->palette[i * 4 + 0];
+      table[i * 4 + 1] = mode->palette[i * 4 + 1];
+      table[i * 4 + 2] = mode->palette[i * 4 + 2];
+      table[i * 4 + 3] = mode->palette[i * 4 + 3];
+    }
+    else
+    {
+      table[i * 4 + 0] = table[i * 4 + 1] = table[i * 4 + 2] = 0;
+      table[i * 4 + 3] = 255;
+    }
+  }
+}
+
+static void convertPalette8ToRGBA8(unsigned char* out, const unsigned char* in,
+                                   const LodePNGColorMode* mode_in, size_t numpixels)
+{
+  size_t i;
+  unsigned char table[1024];
+  getPaletteTable(table, mode_in);
+  for(i = 0; i != numpixels; ++i) memcpy(&out[i * 4], &table[in[i] * 4], 4);
+}
+
+static void convertPalette8ToRGB8(unsigned char* out, const unsigned char* in,
+                                  const LodePNGColorMode* mode_in, size_t numpixels)
+{
+  size_t i;
+  unsigned char table[1024];
+  getPaletteTable(table, mode_in);
+  for(i = 0; i != numpixels; ++i)
+  {
+    const unsigned char* color = &table[in[i] * 4];
+    out[i * 3 + 0] = color[0];
+    out[i * 3 + 1] = color[1];
+    out[i * 3 + 2] = color[2];
+  }
+}
+
+typedef struct ColorConvertFastPath
+{
+  LodePNGColorType colortype_in;
+  unsigned bitdepth_in;
+  LodePNGColorType colortype_out;
+  unsigned bitdepth_out;
+  ColorConvertFunc convert;
+} ColorConvertFastPath;
+
+/*The conversions that lodepng_convert does with a specialized function, keyed by input and output mode.
+The color key of either mode never matters for these, since none of them can output alpha from a key.*/
+static const ColorConvertFastPath color_convert_fast_paths[] =
+{
+  {LCT_RGBA, 8, LCT_RGB, 8, convertRGBA8ToRGB8},
+  {LCT_RGBA, 16, LCT_RGBA, 8, convertRGBA16ToRGBA8},
+  {LCT_RGBA, 8, LCT_GREY, 8, convertRGBA8ToGrey8},
+  {LCT_PALETTE, 8, LCT_RGBA, 8, convertPalette8ToRGBA8},
+  {LCT_PALETTE, 8, LCT_RGB, 8, convertPalette8ToRGB8}
+};
+
+static ColorConvertFunc getColorConvertFastPath(const LodePNGColorMode* mode_out, const LodePNGColorMode* mode_in)
+{
+  size_t i;
+  for(i = 0; i != sizeof(color_convert_fast_paths) / sizeof(color_convert_fast_paths[0]); ++i)
+  {
+    const ColorConvertFastPath* path = &color_convert_fast_paths[i];
+    if(path->colortype_in == mode_in->colortype && path->bitdepth_in == mode_in->bitdepth
+       && path->colortype_out == mode_out->colortype && path->bitdepth_out == mode_out->bitdepth)
+    {
+      return path->convert;
+    }
+  }
+  return 0;
+}
+
 unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
                          const LodePNGColorMode* mode_out, const LodePNGColorMode* mode_in,
                          unsigned w, unsigned h)
 {
   size_t i;
   ColorTree tree;
+  ColorConvertFunc fast_path;
   size_t numpixels = w * h;
 
   if(lodepng_color_mode_equal(mode_out, mode_in))
@@ -3471,6 +4220,13 @@ unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
     return 0;
   }
 
+  fast_path = getColorConvertFastPath(mode_out, mode_in);
+  if(fast_path)
+  {
+    fast_path(out, in, mode_in, numpixels);
+    return 0;
+  }
+
   if(mode_out->colortype == LCT_PALETTE)
   {
     size_t palettesize = mode_out->palettesize;
@@ -3562,16 +4318,30 @@ static unsigned getValueRequiredBits(unsigned char value)
   return 8;
 }
 
-/*profile must already have been inited with mode.
-It's ok to set some parameters of profile to done already.*/
-unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
-                                   const unsigned char* in, unsigned w, unsigned h,
-                                   const LodePNGColorMode* mode)
+/*minimum amount of pixels for which it's worth starting a thread in lodepng_get_color_profile*/
+#define COLOR_PROFILE_MIN_TASK_PIXELS 65536u
+
+/*A part of the pixels of an image, and the profile of only those pixels*/
+typedef struct ColorProfileScan
 {
-  unsigned error = 0;
+  LodePNGColorProfile profile; /*starts as a copy of the profile given to lodepng_get_color_profile*/
+  ColorTree tree; /*the colors counted in profile.numcolors*/
+  const unsigned char* in;
+  const LodePNGColorMode* mode;
+  size_t begin, end; /*the range of pixels to scan*/
+  unsigned sixteen; /*whether the image is truly 16-bit*/
+} ColorProfileScan;
+
+/*Profiles the pixels of one ColorProfileScan. Stops early once nothing can change anymore, that
+is also once more colors were found than a palette can have. If alpha is found, key is reset,
+otherwise key is the color of the first fully transparent pixel of this range.*/
+static void color_profile_scan(void* context, unsigned task)
+{
+  ColorProfileScan* scan = &((ColorProfileScan*)context)[task];
+  LodePNGColorProfile* profile = &scan->profile;
+  const unsigned char* in = scan->in;
+  const LodePNGColorMode* mode = scan->mode;
   size_t i;
-  ColorTree tree;
-  size_t numpixels = w * h;
 
   unsigned colored_done = lodepng_is_greyscale_type(mode) ? 1 : 0;
   unsigned alpha_done = lodepng_can_have_alpha(mode) ? 0 : 1;
@@ -3579,34 +4349,15 @@ unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
   unsigned bpp = lodepng_get_bpp(mode);
   unsigned bits_done = bpp == 1 ? 1 : 0;
   unsigned maxnumcolors = 257;
-  unsigned sixteen = 0;
   if(bpp <= 8) maxnumcolors = bpp == 1 ? 2 : (bpp == 2 ? 4 : (bpp == 4 ? 16 : 256));
 
-  color_tree_init(&tree);
-
-  /*Check if the 16-bit input is truly 16-bit*/
-  if(mode->bitdepth == 16)
-  {
-    unsigned short r, g, b, a;
-    for(i = 0; i != numpixels; ++i)
-    {
-      getPixelColorRGBA16(&r, &g, &b, &a, in, i, mode);
-      if((r & 255) != ((r >> 8) & 255) || (g & 255) != ((g >> 8) & 255) ||
-         (b & 255) != ((b >> 8) & 255) || (a & 255) != ((a >> 8) & 255)) /*first and second byte differ*/
-      {
-        sixteen = 1;
-        break;
-      }
-    }
-  }
-
-  if(sixteen)
+  if(scan->sixteen)
   {
     unsigned short r = 0, g = 0, b = 0, a = 0;
     profile->bits = 16;
     bits_done = numcolors_done = 1; /*counting colors no longer useful, palette doesn't support 16-bit*/
 
-    for(i = 0; i != numpixels; ++i)
+    for(i = scan->begin; i != scan->end; ++i)
     {
       getPixelColorRGBA16(&r, &g, &b, &a, in, i, mode);
 
@@ -3642,26 +4393,11 @@ unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
       }
       if(alpha_done && numcolors_done && colored_done && bits_done) break;
     }
-
-    if(profile->key && !profile->alpha)
-    {
-      for(i = 0; i != numpixels; ++i)
-      {
-        getPixelColorRGBA16(&r, &g, &b, &a, in, i, mode);
-        if(a != 0 && r == profile->key_r && g == profile->key_g && b == profile->key_b)
-        {
-          /* Color key cannot be used if an opaque pixel also has that RGB color. */
-          profile->alpha = 1;
-          profile->key = 0;
-          alpha_done = 1;
-        }
-      }
-    }
   }
   else /* < 16-bit */
   {
     unsigned char r = 0, g = 0, b = 0, a = 0;
-    for(i = 0; i != numpixels; ++i)
+    for(i = scan->begin; i != scan->end; ++i)
     {
       getPixelColorRGBA8(&r, &g, &b, &a, in, i, mode);
 
@@ -3709,9 +4445,9 @@ unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
 
       if(!numcolors_done)
       {
-        if(!color_tree_has(&tree, r, g, b, a))
+        if(!color_tree_has(&scan->tree, r, g, b, a))
         {
-          color_tree_add(&tree, r, g, b, a, profile->numcolors);
+          color_tree_add(&scan->tree, r, g, b, a, profile->numcolors);
           if(profile->numcolors < 256)
           {
             unsigned char* p = profile->palette;
@@ -3728,31 +4464,151 @@ unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
 
       if(alpha_done && numcolors_done && colored_done && bits_done) break;
     }
-
-    if(profile->key && !profile->alpha)
+  }
+}
+
+/*profile must already have been inited with mode.
+It's ok to set some parameters of profile to done already.
+The pixels are profiled in consecutive ranges, possibly in parallel, and the partial profiles are then
+merged in order: the result, including the order of the palette, is the same as that of one sequential scan.*/
+unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
+                                   const unsigned char* in, unsigned w, unsigned h,
+                                   const LodePNGColorMode* mode)
+{
+  size_t i, j;
+  ColorTree tree;
+  ColorProfileScan* scans;
+  size_t numpixels = w * h;
+  unsigned numscans = lodepng_num_tasks(numpixels, COLOR_PROFILE_MIN_TASK_PIXELS);
+  unsigned bpp = lodepng_get_bpp(mode);
+  unsigned maxnumcolors = 257;
+  unsigned sixteen = 0;
+  if(bpp <= 8) maxnumcolors = bpp == 1 ? 2 : (bpp == 2 ? 4 : (bpp == 4 ? 16 : 256));
+
+  /*Check if the 16-bit input is truly 16-bit*/
+  if(mode->bitdepth == 16)
+  {
+    unsigned short r, g, b, a;
+    for(i = 0; i != numpixels; ++i)
+    {
+      getPixelColorRGBA16(&r, &g, &b, &a, in, i, mode);
+      if((r & 255) != ((r >> 8) & 255) || (g & 255) != ((g >> 8) & 255) ||
+         (b & 255) != ((b >> 8) & 255) || (a & 255) != ((a >> 8) & 255)) /*first and second byte differ*/
+      {
+        sixteen = 1;
+        break;
+      }
+    }
+  }
+
+  scans = (ColorProfileScan*)lodepng_malloc(numscans * sizeof(ColorProfileScan));
+  if(!scans) return 83; /*alloc fail*/
+  for(i = 0; i != numscans; ++i)
+  {
+    scans[i].profile = *profile;
+    scans[i].profile.numcolors = 0;
+    color_tree_init(&scans[i].tree);
+    scans[i].in = in;
+    scans[i].mode = mode;
+    scans[i].begin = numpixels * i / numscans;
+    scans[i].end = numpixels * (i + 1) / numscans;
+    scans[i].sixteen = sixteen;
+  }
+
+  lodepng_run_tasks(color_profile_scan, scans, numscans);
+
+  if(sixteen) profile->bits = 16;
+  color_tree_init(&tree);
+  for(i = 0; i != numscans; ++i)
+  {
+    const LodePNGColorProfile* part = &scans[i].profile;
+    if(part->colored) profile->colored = 1;
+    if(part->bits > profile->bits) profile->bits = part->bits;
+
+    if(part->alpha)
     {
-      for(i = 0; i != numpixels; ++i)
+      profile->alpha = 1;
+      profile->key = 0;
+    }
+    else if(part->key && !profile->alpha)
+    {
+      if(!profile->key)
+      {
+        profile->key = 1;
+        profile->key_r = part->key_r;
+        profile->key_g = part->key_g;
+        profile->key_b = part->key_b;
+      }
+      else if(part->key_r != profile->key_r || part->key_g != profile->key_g || part->key_b != profile->key_b)
+      {
+        /*two different fully transparent colors, a color key can't represent that*/
+        profile->alpha = 1;
+        profile->key = 0;
+      }
+    }
+    if(profile->alpha && !sixteen && profile->bits < 8) profile->bits = 8;
+
+    /*the colors of this part that weren't in the earlier parts follow them, in the order found*/
+    for(j = 0; j < part->numcolors && j < 256 && profile->numcolors < maxnumcolors; ++j)
+    {
+      const unsigned char* p = &part->palette[j * 4];
+      if(!color_tree_has(&tree, p[0], p[1], p[2], p[3]))
       {
-        getPixelColorRGBA8(&r, &g, &b, &a, in, i, mode);
-        if(a != 0 && r == profile->key_r && g == profile->key_g && b == profile->key_b)
+        color_tree_add(&tree, p[0], p[1], p[2], p[3], profile->numcolors);
+        if(profile->numcolors < 256)
         {
-          /* Color key cannot be used if an opaque pixel also has that RGB color. */
-          profile->alpha = 1;
-          profile->key = 0;
-          alpha_done = 1;
-          if(profile->bits < 8) profile->bits = 8; /*PNG has no alphachannel modes with less than 8-bit per channel*/
+          unsigned char* q = &profile->palette[profile->numcolors * 4];
+          q[0] = p[0];
+          q[1] = p[1];
+          q[2] = p[2];
+          q[3] = p[3];
         }
+        ++profile->numcolors;
       }
     }
+    /*the part stopped counting at 257 colors of which only 256 are remembered, so the whole image has at least as many*/
+    if(part->numcolors > 256 && profile->numcolors < maxnumcolors)
+    {
+      profile->numcolors = maxnumcolors;
+    }
+  }
+  lodepng_free(scans);
 
+  if(profile->key && !profile->alpha)
+  {
+    for(i = 0; i != numpixels; ++i)
+    {
+      unsigned short r = 0, g = 0, b = 0, a = 0;
+      if(sixteen) getPixelColorRGBA16(&r, &g, &b, &a, in, i, mode);
+      else
+      {
+        unsigned char r8 = 0, g8 = 0, b8 = 0, a8 = 0;
+        getPixelColorRGBA8(&r8, &g8, &b8, &a8, in, i, mode);
+        r = r8;
+        g = g8;
+        b = b8;
+        a = a8;
+      }
+      if(a != 0 && r == profile->key_r && g == profile->key_g && b == profile->key_b)
+      {
+        /* Color key cannot be used if an opaque pixel also has that RGB color. */
+        profile->alpha = 1;
+        profile->key = 0;
+        if(!sixteen && profile->bits < 8) profile->bits = 8; /*PNG has no alphachannel modes with less than 8-bit per channel*/
+        break;
+      }
+    }
+  }
+
+  if(!sixteen)
+  {
     /*make the profile's key always 16-bit for consistency - repeat each byte twice*/
     profile->key_r += (profile->key_r << 8);
     profile->key_g += (profile->key_g << 8);
     profile->key_b += (profile->key_b << 8);
   }
 
-  color_tree_cleanup(&tree);
-  return error;
+  return 0;
 }
 
 /*Automatically chooses color type that gives smallest amount of bits in the
@@ -3893,6 +4749,89 @@ static void Adam7_getpassvalues(unsigned passw[7], unsigned passh[7], size_t fil
   }
 }
 
+/*at least this many bytes of image per task when copying between the passes and the image in parallel*/
+#define ADAM7_MIN_TASK_BYTES 262144u
+
+/*
+Context for copying pixels between the non-interlaced image and the Adam7 passes when bpp is a multiple of 8.
+The rows of the 7 passes are numbered one after another and every task gets a range of them: every row
+of a pass comes from different pixels of the image, so no two tasks ever write to the same bytes.
+*/
+typedef struct Adam7Copy
+{
+  unsigned char* out;
+  const unsigned char* in;
+  unsigned w;
+  unsigned passw[7], passh[7];
+  size_t passstart[8];
+  size_t bytewidth;
+  unsigned interlace; /*1: in is the image and out the passes, 0: in is the passes and out the image*/
+  size_t numrows; /*total amount of rows of all passes*/
+  unsigned numtasks;
+} Adam7Copy;
+
+/*copies num pixels of bytewidth bytes, with outstep and instep bytes between the starts of the pixels*/
+static void adam7CopyPixels(unsigned char* out, size_t outstep, const unsigned char* in, size_t instep,
+                            size_t bytewidth, unsigned num)
+{
+  unsigned x;
+  /*with a constant size, the compiler turns memcpy into a plain load and store per pixel*/
+  switch(bytewidth)
+  {
+    case 1: for(x = 0; x != num; ++x, out += outstep, in += instep) *out = *in; break;
+    case 2: for(x = 0; x != num; ++x, out += outstep, in += instep) memcpy(out, in, 2); break;
+    case 3: for(x = 0; x != num; ++x, out += outstep, in += instep) memcpy(out, in, 3); break;
+    case 4: for(x = 0; x != num; ++x, out += outstep, in += instep) memcpy(out, in, 4); break;
+    case 6: for(x = 0; x != num; ++x, out += outstep, in += instep) memcpy(out, in, 6); break;
+    case 8: for(x = 0; x != num; ++x, out += outstep, in += instep) memcpy(out, in, 8); break;
+    default: for(x = 0; x != num; ++x, out += outstep, in += instep) memcpy(out, in, bytewidth); break;
+  }
+}
+
+static void adam7_copy_task(void* context, unsigned task)
+{
+  const Adam7Copy* c = (const Adam7Copy*)context;
+  size_t rowspertask = (c->numrows + c->numtasks - 1) / c->numtasks;
+  size_t row = rowspertask * task;
+  size_t end = row + rowspertask;
+  size_t passrow = 0; /*the number of the first row of pass i*/
+  unsigned i = 0;
+  if(end > c->numrows) end = c->numrows;
+  for(; row < end; ++row)
+  {
+    size_t y, imagestart, passstart, step;
+    while(row >= passrow + c->passh[i]) passrow += c->passh[i++];
+    y = row - passrow;
+    imagestart = ((ADAM7_IY[i] + y * ADAM7_DY[i]) * c->w + ADAM7_IX[i]) * c->bytewidth;
+    passstart = c->passstart[i] + y * c->passw[i] * c->bytewidth;
+    step = ADAM7_DX[i] * c->bytewidth;
+    if(c->interlace) adam7CopyPixels(&c->out[passstart], c->bytewidth, &c->in[imagestart], step, c->bytewidth, c->passw[i]);
+    else adam7CopyPixels(&c->out[imagestart], step, &c->in[passstart], c->bytewidth, c->bytewidth, c->passw[i]);
+  }
+}
+
+/*Adam7_interlace (interlace = 1) or Adam7_deinterlace (interlace = 0) for bpp that is a multiple of 8*/
+static void Adam7_copyBytes(unsigned char* out, const unsigned char* in, unsigned w, unsigned h, unsigned bpp,
+                            unsigned interlace)
+{
+  Adam7Copy c;
+  size_t filter_passstart[8], padded_passstart[8];
+  unsigned i;
+
+  Adam7_getpassvalues(c.passw, c.passh, filter_passstart, padded_passstart, c.passstart, w, h, bpp);
+  c.out = out;
+  c.in = in;
+  c.w = w;
+  c.bytewidth = bpp / 8;
+  c.interlace = interlace;
+  c.numrows = 0;
+  for(i = 0; i != 7; ++i) c.numrows += c.passh[i];
+  c.numtasks = lodepng_num_tasks(c.passstart[7], ADAM7_MIN_TASK_BYTES);
+  if(c.numrows == 0) return;
+  if(c.numtasks > c.numrows) c.numtasks = (unsigned)c.numrows;
+  lodepng_run_tasks(adam7_copy_task, &c, c.numtasks);
+}
+
 #ifdef LODEPNG_COMPILE_DECODER
 
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -4088,45 +5027,31 @@ static void Adam7_deinterlace(unsigned char* out, const unsigned char* in, unsig
   size_t filter_passstart[8], padded_passstart[8], passstart[8];
   unsigned i;
 
-  Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, w, h, bpp);
-
   if(bpp >= 8)
   {
-    for(i = 0; i != 7; ++i)
-    {
-      unsigned x, y, b;
-      size_t bytewidth = bpp / 8;
-      for(y = 0; y < passh[i]; ++y)
-      for(x = 0; x < passw[i]; ++x)
-      {
-        size_t pixelinstart = passstart[i] + (y * passw[i] + x) * bytewidth;
-        size_t pixeloutstart = ((ADAM7_IY[i] + y * ADAM7_DY[i]) * w + ADAM7_IX[i] + x * ADAM7_DX[i]) * bytewidth;
-        for(b = 0; b < bytewidth; ++b)
-        {
-          out[pixeloutstart + b] = in[pixelinstart + b];
-        }
-      }
-    }
+    Adam7_copyBytes(out, in, w, h, bpp, 0);
+    return;
   }
-  else /*bpp < 8: Adam7 with pixels < 8 bit is a bit trickier: with bit pointers*/
+
+  Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, w, h, bpp);
+
+  /*bpp < 8: Adam7 with pixels < 8 bit is a bit trickier: with bit pointers*/
+  for(i = 0; i != 7; ++i)
   {
-    for(i = 0; i != 7; ++i)
+    unsigned x, y, b;
+    unsigned ilinebits = bpp * passw[i];
+    unsigned olinebits = bpp * w;
+    size_t obp, ibp; /*bit pointers (for out and in buffer)*/
+    for(y = 0; y < passh[i]; ++y)
+    for(x = 0; x < passw[i]; ++x)
     {
-      unsigned x, y, b;
-      unsigned ilinebits = bpp * passw[i];
-      unsigned olinebits = bpp * w;
-      size_t obp, ibp; /*bit pointers (for out and in buffer)*/
-      for(y = 0; y < passh[i]; ++y)
-      for(x = 0; x < passw[i]; ++x)
+      ibp = (8 * passstart[i]) + (y * ilinebits + x * bpp);
+      obp = (ADAM7_IY[i] + y * ADAM7_DY[i]) * olinebits + (ADAM7_IX[i] + x * ADAM7_DX[i]) * bpp;
+      for(b = 0; b < bpp; ++b)
       {
-        ibp = (8 * passstart[i]) + (y * ilinebits + x * bpp);
-        obp = (ADAM7_IY[i] + y * ADAM7_DY[i]) * olinebits + (ADAM7_IX[i] + x * ADAM7_DX[i]) * bpp;
-        for(b = 0; b < bpp; ++b)
-        {
-          unsigned char bit = readBitFromReversedStream(&ibp, in);
-          /*note that this function assumes the out buffer is completely 0, use setBitOfReversedStream otherwise*/
-          setBitOfReversedStream0(&obp, out, bit);
-        }
+        unsigned char bit = readBitFromReversedStream(&ibp, in);
+        /*note that this function assumes the out buffer is completely 0, use setBitOfReversedStream otherwise*/
+        setBitOfReversedStream0(&obp, out, bit);
       }
     }
   }
@@ -4518,6 +5443,127 @@ static unsigned readChunk_pHYs(LodePNGInfo* info, const unsigned char* data, siz
 }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
+#ifdef LODEPNG_COMPILE_ZLIB
+#define BAND_MIN_TASK_BYTES 262144u
+
+/*Context for decoding the row bands of an image with a band index, see decodeBands*/
+typedef struct BandDecode
+{
+  unsigned char* out;
+  const unsigned char* idat; /*the zlib data*/
+  size_t idatsize;
+  const unsigned char* offsets; /*where every band starts in idat, 4 bytes each*/
+  ucvector* scanlines; /*per band, reserved for its filtered rows*/
+  unsigned* adlers; /*per band, the adler32 of its filtered rows*/
+  unsigned* errors; /*per band*/
+  unsigned w, h, bpp, band_rows, numbands, numtasks;
+} BandDecode;
+
+static void band_decode_task(void* context, unsigned task)
+{
+  const BandDecode* c = (const BandDecode*)context;
+  size_t linebytes = ((size_t)c->w * c->bpp + 7) / 8;
+  unsigned b;
+  for(b = task; b < c->numbands; b += c->numtasks)
+  {
+    unsigned last = (b + 1 == c->numbands);
+    size_t start = lodepng_read32bitInt(&c->offsets[4 * b]);
+    size_t end = last ? c->idatsize - 4 : lodepng_read32bitInt(&c->offsets[4 * b + 4]);
+    unsigned rows = last ? c->h - b * c->band_rows : c->band_rows;
+    ucvector* scanlines = &c->scanlines[b];
+    unsigned error = inflateBlocks(scanlines, &c->idat[start], end - start, last);
+    if(!error && scanlines->size != rows * (linebytes + 1)) error = 91; /*decompressed size doesn't match*/
+    /*the first row of a band may not refer to the row above, which is another task's*/
+    if(!error && b != 0 && scanlines->data[0] > 1) error = 36;
+    if(!error)
+    {
+      c->adlers[b] = adler32(scanlines->data, (unsigned)scanlines->size);
+      error = unfilter(&c->out[(size_t)b * c->band_rows * linebytes], scanlines->data, c->w, rows, c->bpp);
+    }
+    c->errors[b] = error;
+  }
+}
+
+/*
+Decodes the zlib data idat of an image with the band index of an "lpIX" chunk, which LodePNG writes with
+LodePNGEncoderSettings::band_rows: every band is inflated, checked and unfiltered on its own, spread over
+multiple threads. Returns 1 with the image in *out if that worked. Returns 0 if the index doesn't match
+the image, the threads wouldn't help or any band fails, in which case the image must be decoded the usual
+way, which also reports the actual error if there is one.
+Unlike encoder tasks, these may allocate: decoding never uses the encoder's arena.
+*/
+static unsigned decodeBands(unsigned char** out, const unsigned char* idat, size_t idatsize,
+                            const unsigned char* index, size_t indexsize,
+                            unsigned w, unsigned h, const LodePNGState* state)
+{
+  const LodePNGDecompressSettings* settings = &state->decoder.zlibsettings;
+  BandDecode c;
+  size_t linebytes;
+  unsigned b, numtasks, ok = 1;
+
+  if(state->info_png.interlace_method != 0 || settings->custom_zlib || settings->custom_inflate) return 0;
+  c.bpp = lodepng_get_bpp(&state->info_png.color);
+  linebytes = ((size_t)w * c.bpp + 7) / 8;
+  if(linebytes * 8 != (size_t)w * c.bpp) return 0; /*padding bits, which unfilter doesn't remove*/
+
+  if(indexsize < 8 || idatsize < 7) return 0;
+  c.band_rows = lodepng_read32bitInt(index);
+  if(c.band_rows == 0 || c.band_rows >= h) return 0;
+  c.numbands = (h - 1) / c.band_rows + 1;
+  if(indexsize != 4 + 4 * (size_t)c.numbands) return 0;
+  /*the same zlib header checks as lodepng_zlib_decompress*/
+  if((idat[0] * 256 + idat[1]) % 31 != 0 || (idat[0] & 15) != 8 || (idat[0] >> 4) > 7 || (idat[1] & 32)) return 0;
+  /*the bands follow each other, the first right after the zlib header and the last before the adler32*/
+  c.offsets = &index[4];
+  if(lodepng_read32bitInt(&c.offsets[0]) != 2) return 0;
+  for(b = 1; b != c.numbands; ++b)
+  {
+    size_t start = lodepng_read32bitInt(&c.offsets[4 * b]);
+    if(start <= lodepng_read32bitInt(&c.offsets[4 * b - 4]) || start >= idatsize - 4) return 0;
+  }
+
+  numtasks = lodepng_num_tasks(h * linebytes, BAND_MIN_TASK_BYTES);
+  if(numtasks > c.numbands) numtasks = c.numbands;
+  if(numtasks < 2) return 0; /*no faster than decoding it the usual way*/
+
+  c.out = (unsigned char*)lodepng_malloc(h * linebytes);
+  c.scanlines = (ucvector*)lodepng_malloc(c.numbands * sizeof(ucvector));
+  c.adlers = (unsigned*)lodepng_malloc(c.numbands * 2 * sizeof(unsigned));
+  if(!c.out || !c.scanlines || !c.adlers) ok = 0;
+  if(c.scanlines) for(b = 0; b != c.numbands; ++b) ucvector_init(&c.scanlines[b]);
+  for(b = 0; ok && b != c.numbands; ++b)
+  {
+    unsigned rows = (b + 1 == c.numbands) ? h - b * c.band_rows : c.band_rows;
+    if(!ucvector_reserve(&c.scanlines[b], rows * (linebytes + 1))) ok = 0;
+  }
+
+  if(ok)
+  {
+    c.errors = &c.adlers[c.numbands];
+    c.idat = idat;
+    c.idatsize = idatsize;
+    c.w = w;
+    c.h = h;
+    c.numtasks = numtasks;
+    lodepng_run_tasks(band_decode_task, &c, numtasks);
+    for(b = 0; ok && b != c.numbands; ++b) if(c.errors[b]) ok = 0;
+  }
+  if(ok && !settings->ignore_adler32)
+  {
+    unsigned adler = c.adlers[0];
+    for(b = 1; b != c.numbands; ++b) adler = adler32_combine(adler, c.adlers[b], c.scanlines[b].size);
+    if(adler != lodepng_read32bitInt(&idat[idatsize - 4])) ok = 0;
+  }
+
+  if(c.scanlines) for(b = 0; b != c.numbands; ++b) ucvector_cleanup(&c.scanlines[b]);
+  lodepng_free(c.scanlines);
+  lodepng_free(c.adlers);
+  if(ok) *out = c.out;
+  else lodepng_free(c.out);
+  return ok;
+}
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
 /*read a PNG, the result will be in the same color type as the PNG (hence "generic")*/
 static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
                           LodePNGState* state,
@@ -4531,6 +5577,10 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
   size_t predict;
   size_t numpixels;
   size_t outsize = 0;
+#ifdef LODEPNG_COMPILE_ZLIB
+  const unsigned char* bandindex = 0; /*the data of the "lpIX" chunk, see decodeBands*/
+  size_t bandindexsize = 0;
+#endif /*LODEPNG_COMPILE_ZLIB*/
 
   /*for unknown chunk order*/
   unsigned unknown = 0;
@@ -4652,6 +5702,14 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
       if(state->error) break;
     }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+#ifdef LODEPNG_COMPILE_ZLIB
+    /*band index chunk (lpIX), private to LodePNG*/
+    else if(state->decoder.read_band_index && lodepng_chunk_type_equals(chunk, "lpIX"))
+    {
+      bandindex = data;
+      bandindexsize = chunkLength;
+    }
+#endif /*LODEPNG_COMPILE_ZLIB*/
     else /*it's not an implemented chunk type, so ignore it: skip over the data*/
     {
       /*error: unknown critical chunk (5th bit of first byte of chunk type is 0)*/
@@ -4676,6 +5734,14 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
     if(!IEND) chunk = lodepng_chunk_next_const(chunk);
   }
 
+#ifdef LODEPNG_COMPILE_ZLIB
+  if(!state->error && bandindex && decodeBands(out, idat.data, idat.size, bandindex, bandindexsize, *w, *h, state))
+  {
+    ucvector_cleanup(&idat);
+    return;
+  }
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
   ucvector_init(&scanlines);
   /*predict output size, to allocate exact size for output buffer to avoid more dynamic allocation.
   If the decompressed size does not match the prediction, the image must be corrupt.*/
@@ -4820,6 +5886,7 @@ void lodepng_decoder_settings_init(LodePNGDecoderSettings* settings)
   settings->remember_unknown_chunks = 0;
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
   settings->ignore_crc = 0;
+  settings->read_band_index = 1;
   lodepng_decompress_settings_init(&settings->zlibsettings);
 }
 
@@ -4834,6 +5901,7 @@ void lodepng_state_init(LodePNGState* state)
 #endif /*LODEPNG_COMPILE_DECODER*/
 #ifdef LODEPNG_COMPILE_ENCODER
   lodepng_encoder_settings_init(&state->encoder);
+  state->arena = 0;
 #endif /*LODEPNG_COMPILE_ENCODER*/
   lodepng_color_mode_init(&state->info_raw);
   lodepng_info_init(&state->info_png);
@@ -4968,13 +6036,80 @@ static unsigned addChunk_tRNS(ucvector* out, const LodePNGColorMode* info)
   return error;
 }
 
+#ifdef LODEPNG_COMPILE_ZLIB
+/*
+The IDAT chunks for the filtered scanlines of h rows in bands of band_rows rows, see
+LodePNGEncoderSettings::band_rows. It's one zlib stream in which every band ends with a full flush, so
+it can be inflated on its own, and every band gets its own IDAT chunk. Before them, an "lpIX" chunk
+holds band_rows and then where every band starts in the zlib data, each as 4-byte big endian integer.
+addChunks_bandedZlib writes these chunks for the complete zlib data and the contents of the "lpIX" chunk.
+*/
+static unsigned addChunks_bandedZlib(ucvector* out, const ucvector* zlibdata, const ucvector* index)
+{
+  size_t numbands = index->size / 4 - 1;
+  size_t i;
+  unsigned error = addChunk(out, "lpIX", index->data, index->size);
+  for(i = 0; i != numbands && !error; ++i)
+  {
+    /*the first IDAT also has the zlib header, the last one the adler32*/
+    size_t start = (i == 0) ? 0 : lodepng_read32bitInt(&index->data[4 + 4 * i]);
+    size_t end = (i + 1 == numbands) ? zlibdata->size : lodepng_read32bitInt(&index->data[8 + 4 * i]);
+    error = addChunk(out, "IDAT", &zlibdata->data[start], end - start);
+  }
+  return error;
+}
+
+static unsigned addChunks_bandedIDAT(ucvector* out, const unsigned char* data, size_t datasize,
+                                     unsigned h, unsigned band_rows,
+                                     const LodePNGCompressSettings* zlibsettings)
+{
+  ucvector zlibdata, index;
+  unsigned error = 0;
+  size_t bandsize = datasize / h * band_rows; /*every row has the same size*/
+  size_t numbands = (h - 1) / band_rows + 1;
+  size_t i;
+
+  LODEPNG_COUNT(METRIC_DEFLATE_BYTES, datasize);
+  ucvector_init(&zlibdata);
+  ucvector_init(&index);
+  addZlibHeader(&zlibdata);
+  lodepng_add32bitInt(&index, band_rows);
+  for(i = 0; i != numbands && !error; ++i)
+  {
+    size_t start = i * bandsize;
+    size_t end = (i + 1 == numbands) ? datasize : start + bandsize;
+    if(zlibdata.size > 0xffffffffu) { error = 99; break; } /*the offset doesn't fit in the band index*/
+    lodepng_add32bitInt(&index, (unsigned)zlibdata.size);
+    error = lodepng_deflatev(&zlibdata, &data[start], end - start, zlibsettings, i + 1 == numbands);
+  }
+  if(!error)
+  {
+    lodepng_add32bitInt(&zlibdata, adler32(data, (unsigned)datasize));
+    error = addChunks_bandedZlib(out, &zlibdata, &index);
+  }
+  ucvector_cleanup(&zlibdata);
+  ucvector_cleanup(&index);
+
+  return error;
+}
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
+/*h and band_rows are only used with band_rows not 0, see addChunks_bandedIDAT*/
 static unsigned addChunk_IDAT(ucvector* out, const unsigned char* data, size_t datasize,
-                              LodePNGCompressSettings* zlibsettings)
+                              unsigned h, unsigned band_rows, LodePNGCompressSettings* zlibsettings)
 {
   ucvector zlibdata;
   unsigned error = 0;
 
+#ifdef LODEPNG_COMPILE_ZLIB
+  if(band_rows) return addChunks_bandedIDAT(out, data, datasize, h, band_rows, zlibsettings);
+#else /*LODEPNG_COMPILE_ZLIB*/
+  (void)h;
+  (void)band_rows;
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
   /*compress with the Zlib compressor*/
+  LODEPNG_COUNT(METRIC_DEFLATE_BYTES, datasize);
   ucvector_init(&zlibdata);
   error = zlib_compress(&zlibdata.data, &zlibdata.size, data, datasize, zlibsettings);
   if(!error) error = addChunk(out, "IDAT", zlibdata.data, zlibdata.size);
@@ -5465,53 +6600,62 @@ static void Adam7_interlace(unsigned char* out, const unsigned char* in, unsigne
   size_t filter_passstart[8], padded_passstart[8], passstart[8];
   unsigned i;
 
+  if(bpp >= 8)
+  {
+    Adam7_copyBytes(out, in, w, h, bpp, 1);
+    return;
+  }
+
   Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, w, h, bpp);
 
-  if(bpp >= 8)
+  /*bpp < 8: Adam7 with pixels < 8 bit is a bit trickier: with bit pointers*/
+  for(i = 0; i != 7; ++i)
   {
-    for(i = 0; i != 7; ++i)
+    unsigned x, y, b;
+    unsigned ilinebits = bpp * passw[i];
+    unsigned olinebits = bpp * w;
+    size_t obp, ibp; /*bit pointers (for out and in buffer)*/
+    for(y = 0; y < passh[i]; ++y)
+    for(x = 0; x < passw[i]; ++x)
     {
-      unsigned x, y, b;
-      size_t bytewidth = bpp / 8;
-      for(y = 0; y < passh[i]; ++y)
-      for(x = 0; x < passw[i]; ++x)
+      ibp = (ADAM7_IY[i] + y * ADAM7_DY[i]) * olinebits + (ADAM7_IX[i] + x * ADAM7_DX[i]) * bpp;
+      obp = (8 * passstart[i]) + (y * ilinebits + x * bpp);
+      for(b = 0; b < bpp; ++b)
       {
-        size_t pixelinstart = ((ADAM7_IY[i] + y * ADAM7_DY[i]) * w + ADAM7_IX[i] + x * ADAM7_DX[i]) * bytewidth;
-        size_t pixeloutstart = passstart[i] + (y * passw[i] + x) * bytewidth;
-        for(b = 0; b < bytewidth; ++b)
-        {
-          out[pixeloutstart + b] = in[pixelinstart + b];
-        }
+        unsigned char bit = readBitFromReversedStream(&ibp, in);
+        setBitOfReversedStream(&obp, out, bit);
       }
     }
   }
-  else /*bpp < 8: Adam7 with pixels < 8 bit is a bit trickier: with bit pointers*/
+}
+
+/*
+Filters the first row of every band of band_rows rows after the first again, with Sub, if its filter
+uses the row above, so that every band can be unfiltered on its own, see LodePNGEncoderSettings::band_rows.
+out are the filtered scanlines of in, which has the padding bits if any, like the input of filter.
+*/
+static void filterBandStarts(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
+                             unsigned bpp, unsigned band_rows)
+{
+  size_t linebytes = ((size_t)w * bpp + 7) / 8;
+  size_t bytewidth = (bpp + 7) / 8;
+  unsigned y;
+  for(y = band_rows; y < h; y += band_rows)
   {
-    for(i = 0; i != 7; ++i)
+    unsigned char* line = &out[y * (linebytes + 1)];
+    if(line[0] > 1)
     {
-      unsigned x, y, b;
-      unsigned ilinebits = bpp * passw[i];
-      unsigned olinebits = bpp * w;
-      size_t obp, ibp; /*bit pointers (for out and in buffer)*/
-      for(y = 0; y < passh[i]; ++y)
-      for(x = 0; x < passw[i]; ++x)
-      {
-        ibp = (ADAM7_IY[i] + y * ADAM7_DY[i]) * olinebits + (ADAM7_IX[i] + x * ADAM7_DX[i]) * bpp;
-        obp = (8 * passstart[i]) + (y * ilinebits + x * bpp);
-        for(b = 0; b < bpp; ++b)
-        {
-          unsigned char bit = readBitFromReversedStream(&ibp, in);
-          setBitOfReversedStream(&obp, out, bit);
-        }
-      }
+      line[0] = 1;
+      filterScanline(&line[1], &in[y * linebytes], 0, linebytes, bytewidth, 1);
     }
   }
 }
 
 /*out must be buffer big enough to contain uncompressed IDAT chunk data, and in must contain the full image.
+band_rows is 0 or the LodePNGEncoderSettings::band_rows used, which is only possible without Adam7.
 return value is error**/
 static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const unsigned char* in,
-                                    unsigned w, unsigned h,
+                                    unsigned w, unsigned h, unsigned band_rows,
                                     const LodePNGInfo* info_png, const LodePNGEncoderSettings* settings)
 {
   /*
@@ -5539,6 +6683,7 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
         {
           addPaddingBits(padded, in, ((w * bpp + 7) / 8) * 8, w * bpp, h);
           error = filter(*out, padded, w, h, &info_png->color, settings);
+          if(!error && band_rows) filterBandStarts(*out, padded, w, h, bpp, band_rows);
         }
         lodepng_free(padded);
       }
@@ -5546,6 +6691,7 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
       {
         /*we can immediately filter into the out buffer, no other steps needed*/
         error = filter(*out, in, w, h, &info_png->color, settings);
+        if(!error && band_rows) filterBandStarts(*out, in, w, h, bpp, band_rows);
       }
     }
   }
@@ -5597,6 +6743,142 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
   return error;
 }
 
+#ifdef LODEPNG_COMPILE_ZLIB
+/*the least raw image bytes per task when encoding bands in parallel*/
+#define BAND_ENCODE_MIN_TASK_BYTES 262144u
+
+typedef struct BandEncode
+{
+  const unsigned char* image;
+  const LodePNGColorMode* mode_raw; /*the color mode of image*/
+  const LodePNGColorMode* mode_png; /*the color mode in the PNG*/
+  const LodePNGEncoderSettings* settings;
+  unsigned w, h, band_rows, numbands, numtasks;
+  ucvector* bands; /*the deflate data of every band*/
+  unsigned* adlers; /*the adler32 of the filtered scanlines of every band*/
+  unsigned* errors; /*the error of every task*/
+} BandEncode;
+
+/*converts, filters and deflates band b on its own*/
+static unsigned encodeBand(const BandEncode* c, unsigned b)
+{
+  size_t rawlinebytes = (size_t)c->w * lodepng_get_bpp(c->mode_raw) / 8;
+  size_t linebytes = (size_t)c->w * lodepng_get_bpp(c->mode_png) / 8;
+  unsigned y = b * c->band_rows;
+  unsigned rows = (b + 1 == c->numbands) ? c->h - y : c->band_rows;
+  /*the row above the band is filtered along, so that every row gets the filter it gets in the whole image*/
+  unsigned above = y ? 1 : 0;
+  const unsigned char* in = &c->image[(y - above) * rawlinebytes];
+  unsigned char* converted = 0;
+  unsigned char* filtered = 0;
+  unsigned error = 0;
+  LodePNGEncoderSettings settings = *c->settings;
+
+  if(!lodepng_color_mode_equal(c->mode_raw, c->mode_png))
+  {
+    converted = (unsigned char*)lodepng_malloc((rows + above) * linebytes);
+    if(!converted) error = 83; /*alloc fail*/
+    if(!error) error = lodepng_convert(converted, in, c->mode_png, c->mode_raw, c->w, rows + above);
+    in = converted;
+  }
+  if(!error)
+  {
+    filtered = (unsigned char*)lodepng_malloc((rows + above) * (linebytes + 1));
+    if(!filtered) error = 83; /*alloc fail*/
+  }
+  if(!error)
+  {
+    if(settings.predefined_filters) settings.predefined_filters += y - above;
+    error = filter(filtered, in, c->w, rows + above, c->mode_png, &settings);
+  }
+  if(!error)
+  {
+    const unsigned char* band = &filtered[above * (linebytes + 1)];
+    size_t bandsize = rows * (linebytes + 1);
+    if(above) filterBandStarts(filtered, in, c->w, 2, lodepng_get_bpp(c->mode_png), 1);
+    c->adlers[b] = adler32(band, (unsigned)bandsize);
+    LODEPNG_COUNT(METRIC_DEFLATE_BYTES, bandsize);
+    error = lodepng_deflatev(&c->bands[b], band, bandsize, &settings.zlibsettings, b + 1 == c->numbands);
+  }
+  lodepng_free(filtered);
+  lodepng_free(converted);
+  return error;
+}
+
+static void band_encode_task(void* context, unsigned task)
+{
+  BandEncode* c = (BandEncode*)context;
+  unsigned b = task * c->numbands / c->numtasks;
+  unsigned end = (task + 1) * c->numbands / c->numtasks;
+  unsigned error = 0;
+  for(; b != end && !error; ++b) error = encodeBand(c, b);
+  c->errors[task] = error;
+}
+
+/*
+The zlib data and "lpIX" contents of addChunks_bandedIDAT, the same as it makes them, but directly from the
+raw image: every band is converted, filtered and deflated on its own, spread over threads, so the converted
+or filtered image never exists as a whole. The rows of both the raw image and the PNG must end at a byte
+boundary, so that every band starts at one.
+*/
+static unsigned encodeBands(ucvector* zlibdata, ucvector* index, const unsigned char* image,
+                            unsigned w, unsigned h, unsigned band_rows,
+                            const LodePNGColorMode* mode_png, const LodePNGColorMode* mode_raw,
+                            const LodePNGEncoderSettings* settings)
+{
+  BandEncode c;
+  size_t linebytes = (size_t)w * lodepng_get_bpp(mode_png) / 8;
+  size_t i, total = 6; /*the zlib header and adler32*/
+  unsigned adler = 1;
+  unsigned error = 0;
+
+  c.image = image;
+  c.mode_raw = mode_raw;
+  c.mode_png = mode_png;
+  c.settings = settings;
+  c.w = w;
+  c.h = h;
+  c.band_rows = band_rows;
+  c.numbands = (h - 1) / band_rows + 1;
+  c.numtasks = lodepng_num_tasks((size_t)h * w * lodepng_get_bpp(mode_raw) / 8, BAND_ENCODE_MIN_TASK_BYTES);
+  if(c.numtasks > c.numbands) c.numtasks = c.numbands;
+  c.bands = (ucvector*)lodepng_malloc(c.numbands * sizeof(ucvector));
+  c.adlers = (unsigned*)lodepng_malloc(c.numbands * sizeof(unsigned));
+  c.errors = (unsigned*)lodepng_malloc(c.numtasks * sizeof(unsigned));
+  if(!c.bands || !c.adlers || !c.errors) error = 83; /*alloc fail*/
+
+  if(!error)
+  {
+    for(i = 0; i != c.numbands; ++i) ucvector_init(&c.bands[i]);
+    lodepng_run_tasks(band_encode_task, &c, c.numtasks);
+    for(i = 0; i != c.numtasks && !error; ++i) error = c.errors[i];
+    for(i = 0; i != c.numbands; ++i) total += c.bands[i].size;
+    if(!error && !ucvector_reserve(zlibdata, total)) error = 83; /*alloc fail*/
+    if(!error)
+    {
+      addZlibHeader(zlibdata);
+      lodepng_add32bitInt(index, band_rows);
+      for(i = 0; i != c.numbands; ++i)
+      {
+        size_t rows = (i + 1 == c.numbands) ? h - i * band_rows : band_rows;
+        if(zlibdata->size > 0xffffffffu) { error = 99; break; } /*the offset doesn't fit in the band index*/
+        lodepng_add32bitInt(index, (unsigned)zlibdata->size);
+        memcpy(&zlibdata->data[zlibdata->size], c.bands[i].data, c.bands[i].size);
+        zlibdata->size += c.bands[i].size;
+        adler = adler32_combine(adler, c.adlers[i], rows * (linebytes + 1));
+      }
+      if(!error) lodepng_add32bitInt(zlibdata, adler);
+    }
+    for(i = 0; i != c.numbands; ++i) ucvector_cleanup(&c.bands[i]);
+  }
+
+  lodepng_free(c.bands);
+  lodepng_free(c.adlers);
+  lodepng_free(c.errors);
+  return error;
+}
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
 /*
 palette must have 4 * palettesize bytes allocated, and given in format RGBARGBARGBARGBA...
 returns 0 if the palette is opaque,
@@ -5637,14 +6919,16 @@ static unsigned addUnknownChunks(ucvector* out, unsigned char* data, size_t data
 }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
-unsigned lodepng_encode(unsigned char** out, size_t* outsize,
-                        const unsigned char* image, unsigned w, unsigned h,
-                        LodePNGState* state)
+static unsigned encodeGeneric(unsigned char** out, size_t* outsize,
+                              const unsigned char* image, unsigned w, unsigned h,
+                              LodePNGState* state)
 {
   LodePNGInfo info;
   ucvector outv;
   unsigned char* data = 0; /*uncompressed version of the IDAT chunk data*/
   size_t datasize = 0;
+  unsigned band_rows = 0; /*the LodePNGEncoderSettings::band_rows used, if possible*/
+  ucvector bandzlib, bandindex; /*the zlib data of the bands when encodeBands made it*/
 
   /*provide some proper output values if error will happen*/
   *out = 0;
@@ -5675,12 +6959,31 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
   {
     CERROR_RETURN_ERROR(state->error, 71); /*error: unexisting interlace mode*/
   }
+#ifdef LODEPNG_COMPILE_ZLIB
+  /*the bands are compressed separately with the built in deflate, which a custom zlib can't do*/
+  if(info.interlace_method == 0 && h > state->encoder.band_rows
+     && !state->encoder.zlibsettings.custom_zlib && !state->encoder.zlibsettings.custom_deflate)
+  {
+    band_rows = state->encoder.band_rows;
+  }
+#endif /*LODEPNG_COMPILE_ZLIB*/
 
   state->error = checkColorValidity(info.color.colortype, info.color.bitdepth);
   if(state->error) return state->error; /*error: unexisting color type given*/
   state->error = checkColorValidity(state->info_raw.colortype, state->info_raw.bitdepth);
   if(state->error) return state->error; /*error: unexisting color type given*/
 
+  ucvector_init(&bandzlib);
+  ucvector_init(&bandindex);
+#ifdef LODEPNG_COMPILE_ZLIB
+  if(band_rows && (size_t)w * lodepng_get_bpp(&info.color) % 8 == 0
+     && (size_t)w * lodepng_get_bpp(&state->info_raw) % 8 == 0)
+  {
+    state->error = encodeBands(&bandzlib, &bandindex, image, w, h, band_rows,
+                               &info.color, &state->info_raw, &state->encoder);
+  }
+  else
+#endif /*LODEPNG_COMPILE_ZLIB*/
   if(!lodepng_color_mode_equal(&state->info_raw, &info.color))
   {
     unsigned char* converted;
@@ -5692,10 +6995,10 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
     {
       state->error = lodepng_convert(converted, image, &info.color, &state->info_raw, w, h);
     }
-    if(!state->error) preProcessScanlines(&data, &datasize, converted, w, h, &info, &state->encoder);
+    if(!state->error) preProcessScanlines(&data, &datasize, converted, w, h, band_rows, &info, &state->encoder);
     lodepng_free(converted);
   }
-  else preProcessScanlines(&data, &datasize, image, w, h, &info, &state->encoder);
+  else preProcessScanlines(&data, &datasize, image, w, h, band_rows, &info, &state->encoder);
 
   ucvector_init(&outv);
   while(!state->error) /*while only executed once, to break on error*/
@@ -5747,7 +7050,11 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
     }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
     /*IDAT (multiple IDAT chunks must be consecutive)*/
-    state->error = addChunk_IDAT(&outv, data, datasize, &state->encoder.zlibsettings);
+#ifdef LODEPNG_COMPILE_ZLIB
+    if(bandzlib.size) state->error = addChunks_bandedZlib(&outv, &bandzlib, &bandindex);
+    else
+#endif /*LODEPNG_COMPILE_ZLIB*/
+    state->error = addChunk_IDAT(&outv, data, datasize, h, band_rows, &state->encoder.zlibsettings);
     if(state->error) break;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
     /*tIME*/
@@ -5823,6 +7130,8 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
 
   lodepng_info_cleanup(&info);
   lodepng_free(data);
+  ucvector_cleanup(&bandzlib);
+  ucvector_cleanup(&bandindex);
   /*instead of cleaning the vector up, give it to the output*/
   *out = outv.data;
   *outsize = outv.size;
@@ -5830,6 +7139,47 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
   return state->error;
 }
 
+#ifdef LODEPNG_COMPILE_ALLOCATORS
+/*Encodes with all memory, including that of the PNG itself, taken from state->arena.
+The PNG stays valid until the arena is reset, which the next encode with it does.*/
+static unsigned encodeInArena(unsigned char** out, size_t* outsize,
+                              const unsigned char* image, unsigned w, unsigned h,
+                              LodePNGState* state)
+{
+  LodePNGArena* previous = lodepng_thread_arena;
+  lodepng_arena_reset(state->arena);
+  lodepng_thread_arena = state->arena;
+  encodeGeneric(out, outsize, image, w, h, state);
+  lodepng_thread_arena = previous;
+  return state->error;
+}
+#endif /*LODEPNG_COMPILE_ALLOCATORS*/
+
+unsigned lodepng_encode(unsigned char** out, size_t* outsize,
+                        const unsigned char* image, unsigned w, unsigned h,
+                        LodePNGState* state)
+{
+#ifdef LODEPNG_COMPILE_ALLOCATORS
+  if(state->arena)
+  {
+    unsigned char* png;
+    encodeInArena(&png, outsize, image, w, h, state);
+
+    /*the caller frees the result with free or lodepng_free, so it can't stay in the arena*/
+    *out = 0;
+    if(png)
+    {
+      *out = (unsigned char*)lodepng_malloc(*outsize);
+      if(*out) memcpy(*out, png, *outsize);
+      else if(!state->error) state->error = 83; /*alloc fail*/
+    }
+    if(state->error) *outsize = 0;
+    return state->error;
+  }
+#endif /*LODEPNG_COMPILE_ALLOCATORS*/
+  return encodeGeneric(out, outsize, image, w, h, state);
+}
+
 unsigned lodepng_encode_memory(unsigned char** out, size_t* outsize, const unsigned char* image,
                                unsigned w, unsigned h, LodePNGColorType colortype, unsigned bitdepth)
 {
@@ -5879,6 +7229,336 @@ unsigned lodepng_encode24_file(const char* filename, const unsigned char* image,
 }
 #endif /*LODEPNG_COMPILE_DISK*/
 
+/* ////////////////////////////////////////////////////////////////////////// */
+/* / APNG Encoder                                                           / */
+/* ////////////////////////////////////////////////////////////////////////// */
+
+void lodepng_animation_init(LodePNGAnimation* animation)
+{
+  animation->num_plays = 0;
+  animation->data = 0;
+  animation->size = animation->allocsize = 0;
+  animation->w = animation->h = 0;
+  animation->num_frames = 0;
+  animation->sequence = 0;
+  animation->actl = 0;
+  animation->previous = 0;
+  animation->previoussize = 0;
+  lodepng_color_mode_init(&animation->color_raw);
+  lodepng_color_mode_init(&animation->color_png);
+}
+
+void lodepng_animation_cleanup(LodePNGAnimation* animation)
+{
+  lodepng_free(animation->data);
+  lodepng_free(animation->previous);
+  lodepng_color_mode_cleanup(&animation->color_raw);
+  lodepng_color_mode_cleanup(&animation->color_png);
+  lodepng_animation_init(animation);
+}
+
+static unsigned addChunk_acTL(ucvector* out, unsigned num_frames, unsigned num_plays)
+{
+  unsigned char data[8];
+  lodepng_set32bitInt(&data[0], num_frames);
+  lodepng_set32bitInt(&data[4], num_plays);
+  return addChunk(out, "acTL", data, 8);
+}
+
+/*a frame of w * h pixels at x, y that replaces those pixels of the previous frame and then stays*/
+static unsigned addChunk_fcTL(ucvector* out, unsigned sequence, unsigned w, unsigned h, unsigned x, unsigned y,
+                              unsigned delay_num, unsigned delay_den)
+{
+  unsigned char data[26];
+  lodepng_set32bitInt(&data[0], sequence);
+  lodepng_set32bitInt(&data[4], w);
+  lodepng_set32bitInt(&data[8], h);
+  lodepng_set32bitInt(&data[12], x);
+  lodepng_set32bitInt(&data[16], y);
+  data[20] = (unsigned char)(delay_num >> 8);
+  data[21] = (unsigned char)(delay_num & 255);
+  data[22] = (unsigned char)(delay_den >> 8);
+  data[23] = (unsigned char)(delay_den & 255);
+  data[24] = 0; /*dispose_op: none*/
+  data[25] = 0; /*blend_op: source*/
+  return addChunk(out, "fcTL", data, 26);
+}
+
+/*returns whether pixel i of the images a and b, of bpp bits per pixel, differs*/
+static unsigned pixelDiffers(const unsigned char* a, const unsigned char* b, size_t i, unsigned bpp)
+{
+  if(bpp >= 8) return memcmp(&a[i * (bpp / 8)], &b[i * (bpp / 8)], bpp / 8) != 0;
+  else
+  {
+    size_t abp = i * bpp, bbp = i * bpp;
+    return readBitsFromReversedStream(&abp, a, bpp) != readBitsFromReversedStream(&bbp, b, bpp);
+  }
+}
+
+/*
+Finds the smallest rectangle, from x0, y0 up to but not including x1, y1, that holds all pixels that differ
+between the w * h images a and b of bpp bits per pixel. Returns 0 if the images are the same.
+*/
+static unsigned findChangedRect(unsigned* x0, unsigned* y0, unsigned* x1, unsigned* y1,
+                                const unsigned char* a, const unsigned char* b,
+                                unsigned w, unsigned h, unsigned bpp)
+{
+  unsigned x, y;
+  *x0 = w;
+  *y0 = h;
+  *x1 = *y1 = 0;
+  for(y = 0; y != h; ++y)
+  {
+    size_t row = (size_t)y * w;
+    if(bpp >= 8)
+    {
+      if(!memcmp(&a[row * (bpp / 8)], &b[row * (bpp / 8)], (size_t)w * (bpp / 8))) continue;
+    }
+    else
+    {
+      for(x = 0; x != w && !pixelDiffers(a, b, row + x, bpp); ++x) {}
+      if(x == w) continue;
+    }
+    /*only look for changes outside the columns already known to have some*/
+    for(x = 0; x < *x0 && !pixelDiffers(a, b, row + x, bpp); ++x) {}
+    *x0 = x;
+    for(x = w; x > *x1 && !pixelDiffers(a, b, row + x - 1, bpp); --x) {}
+    *x1 = x;
+    if(*y0 == h) *y0 = y;
+    *y1 = y + 1;
+  }
+  return *y1 != 0;
+}
+
+/*copies the w * h pixels at x, y of the image in, which is imagew pixels wide, to out*/
+static void copyRect(unsigned char* out, const unsigned char* in, unsigned x, unsigned y, unsigned w, unsigned h,
+                     unsigned imagew, unsigned bpp)
+{
+  unsigned i, j;
+  if(bpp >= 8)
+  {
+    size_t bytewidth = bpp / 8;
+    for(j = 0; j != h; ++j)
+    {
+      memcpy(&out[(size_t)j * w * bytewidth], &in[((size_t)(y + j) * imagew + x) * bytewidth], w * bytewidth);
+    }
+  }
+  else
+  {
+    size_t obp = 0;
+    for(j = 0; j != h; ++j)
+    {
+      size_t ibp = ((size_t)(y + j) * imagew + x) * bpp;
+      for(i = 0; i != w * bpp; ++i) setBitOfReversedStream(&obp, out, readBitFromReversedStream(&ibp, in));
+    }
+  }
+}
+
+/*
+The chunks of the first frame: those of the PNG of the image up to IEND, with the acTL and fcTL chunks
+before the first IDAT chunk. The acTL chunk gets the amount of frames when the animation is finished.
+*/
+static unsigned addFirstFrame(ucvector* out, LodePNGAnimation* animation,
+                              const unsigned char* image, unsigned w, unsigned h,
+                              unsigned delay_num, unsigned delay_den, LodePNGState* state)
+{
+  unsigned char* png = 0;
+  size_t pngsize = 0;
+  unsigned auto_convert = state->encoder.auto_convert;
+  unsigned error;
+
+  state->encoder.auto_convert = 0;
+  error = lodepng_encode(&png, &pngsize, image, w, h, state);
+  state->encoder.auto_convert = auto_convert;
+
+  if(!error)
+  {
+    const unsigned char* chunk = &png[8];
+    writeSignature(out);
+    while(!lodepng_chunk_type_equals(chunk, "IEND"))
+    {
+      size_t chunksize = lodepng_chunk_length(chunk) + 12;
+      if(lodepng_chunk_type_equals(chunk, "IDAT") && !animation->actl)
+      {
+        animation->actl = out->size;
+        error = addChunk_acTL(out, 0, animation->num_plays);
+        if(!error) error = addChunk_fcTL(out, animation->sequence, w, h, 0, 0, delay_num, delay_den);
+        if(error) break;
+      }
+      if(!ucvector_resize(out, out->size + chunksize)) ERROR_BREAK(83); /*alloc fail*/
+      memcpy(&out->data[out->size - chunksize], chunk, chunksize);
+      chunk = lodepng_chunk_next_const(chunk);
+    }
+  }
+
+  lodepng_free(png);
+  return error;
+}
+
+/*the chunks of a frame after the first, which is the w * h pixels at x, y of image*/
+static unsigned addFrame(ucvector* out, LodePNGAnimation* animation, const unsigned char* image,
+                         unsigned x, unsigned y, unsigned w, unsigned h,
+                         unsigned delay_num, unsigned delay_den, const LodePNGState* state)
+{
+  const LodePNGColorMode* color = &state->info_png.color;
+  unsigned char* rect = (unsigned char*)lodepng_malloc(lodepng_get_raw_size(w, h, &state->info_raw));
+  unsigned char* converted = 0;
+  unsigned char* data = 0; /*the filtered scanlines*/
+  size_t datasize = 0;
+  ucvector zlibdata, fdat;
+  unsigned error = 0;
+
+  ucvector_init(&zlibdata);
+  ucvector_init(&fdat);
+  if(!rect) error = 83; /*alloc fail*/
+  if(!error)
+  {
+    copyRect(rect, image, x, y, w, h, animation->w, lodepng_get_bpp(&state->info_raw));
+    if(!lodepng_color_mode_equal(&state->info_raw, color))
+    {
+      converted = (unsigned char*)lodepng_malloc(lodepng_get_raw_size(w, h, color));
+      if(!converted) error = 83; /*alloc fail*/
+      else error = lodepng_convert(converted, rect, color, &state->info_raw, w, h);
+    }
+  }
+  if(!error)
+  {
+    error = preProcessScanlines(&data, &datasize, converted ? converted : rect, w, h, 0,
+                                &state->info_png, &state->encoder);
+  }
+  if(!error)
+  {
+    LODEPNG_COUNT(METRIC_DEFLATE_BYTES, datasize);
+    error = zlib_compress(&zlibdata.data, &zlibdata.size, data, datasize, &state->encoder.zlibsettings);
+  }
+  if(!error)
+  {
+    /*fdAT is IDAT with a sequence number in front*/
+    if(!ucvector_resize(&fdat, 4 + zlibdata.size)) error = 83; /*alloc fail*/
+    else
+    {
+      lodepng_set32bitInt(fdat.data, animation->sequence + 1);
+      memcpy(&fdat.data[4], zlibdata.data, zlibdata.size);
+      error = addChunk_fcTL(out, animation->sequence, w, h, x, y, delay_num, delay_den);
+    }
+  }
+  if(!error) error = addChunk(out, "fdAT", fdat.data, fdat.size);
+
+  lodepng_free(rect);
+  lodepng_free(converted);
+  lodepng_free(data);
+  ucvector_cleanup(&zlibdata);
+  ucvector_cleanup(&fdat);
+  return error;
+}
+
+unsigned lodepng_animation_add(LodePNGAnimation* animation,
+                               const unsigned char* image, unsigned w, unsigned h,
+                               unsigned delay_num, unsigned delay_den,
+                               LodePNGState* state)
+{
+  size_t rawsize = lodepng_get_raw_size(w, h, &state->info_raw);
+  unsigned x0, y0, x1, y1;
+  ucvector frame;
+  unsigned error = 0;
+
+  if(delay_num > 65535 || delay_den > 65535) CERROR_RETURN_ERROR(state->error, 96);
+  if(animation->num_frames)
+  {
+    if(!animation->previous) CERROR_RETURN_ERROR(state->error, 98); /*already finished*/
+    /*the fdAT chunks are in the color mode of the IHDR and PLTE chunks of the first frame*/
+    if(w != animation->w || h != animation->h || rawsize != animation->previoussize
+       || !lodepng_color_mode_equal(&state->info_raw, &animation->color_raw)
+       || !lodepng_color_mode_equal(&state->info_png.color, &animation->color_png))
+    {
+      CERROR_RETURN_ERROR(state->error, 95);
+    }
+  }
+
+  /*the chunks of the frame are made apart, addChunk grows its output by exactly one chunk every time*/
+  ucvector_init(&frame);
+  if(!animation->num_frames)
+  {
+    error = addFirstFrame(&frame, animation, image, w, h, delay_num, delay_den, state);
+    if(!error) error = lodepng_color_mode_copy(&animation->color_raw, &state->info_raw);
+    if(!error) error = lodepng_color_mode_copy(&animation->color_png, &state->info_png.color);
+    if(!error)
+    {
+      animation->previous = (unsigned char*)lodepng_malloc(rawsize);
+      if(!animation->previous) error = 83; /*alloc fail*/
+    }
+  }
+  else
+  {
+    /*a frame that is the same as the previous one still needs pixels, so it gets the top left one*/
+    if(!findChangedRect(&x0, &y0, &x1, &y1, animation->previous, image, w, h, lodepng_get_bpp(&state->info_raw)))
+    {
+      x0 = y0 = 0;
+      x1 = y1 = 1;
+    }
+    error = addFrame(&frame, animation, image, x0, y0, x1 - x0, y1 - y0, delay_num, delay_den, state);
+  }
+
+  if(!error)
+  {
+    ucvector out;
+    out.data = animation->data;
+    out.size = animation->size;
+    out.allocsize = animation->allocsize;
+    if(!ucvector_resize(&out, out.size + frame.size)) error = 83; /*alloc fail*/
+    else memcpy(&out.data[animation->size], frame.data, frame.size);
+    animation->data = out.data;
+    animation->allocsize = out.allocsize;
+  }
+  if(!error)
+  {
+    animation->size += frame.size;
+    memcpy(animation->previous, image, rawsize);
+    animation->previoussize = rawsize;
+    animation->w = w;
+    animation->h = h;
+    animation->sequence += animation->num_frames ? 2 : 1; /*fcTL and fdAT, or only fcTL for the first frame*/
+    ++animation->num_frames;
+  }
+  else if(!animation->num_frames)
+  {
+    lodepng_free(animation->previous);
+    animation->previous = 0;
+    animation->actl = 0;
+  }
+
+  ucvector_cleanup(&frame);
+  state->error = error;
+  return error;
+}
+
+unsigned lodepng_animation_finish(LodePNGAnimation* animation)
+{
+  ucvector out;
+  unsigned error;
+
+  if(!animation->num_frames) return 97;
+  if(!animation->previous) return 98; /*already finished*/
+
+  lodepng_set32bitInt(&animation->data[animation->actl + 8], animation->num_frames);
+  lodepng_chunk_generate_crc(&animation->data[animation->actl]);
+
+  out.data = animation->data;
+  out.size = animation->size;
+  out.allocsize = animation->allocsize;
+  error = addChunk_IEND(&out);
+  animation->data = out.data;
+  animation->size = out.size;
+  animation->allocsize = out.allocsize;
+
+  if(!error)
+  {
+    lodepng_free(animation->previous);
+    animation->previous = 0;
+  }
+  return error;
+}
+
 void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings)
 {
   lodepng_compress_settings_init(&settings->zlibsettings);
@@ -5887,6 +7567,7 @@ void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings)
   settings->auto_convert = 1;
   settings->force_palette = 0;
   settings->predefined_filters = 0;
+  settings->band_rows = 0;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   settings->add_id = 0;
   settings->text_compression = 1;
@@ -5998,6 +7679,11 @@ const char* lodepng_error_text(unsigned code)
     case 92: return "too many pixels, not supported";
     case 93: return "zero width or height is invalid";
     case 94: return "header chunk must have a size of 13 bytes";
+    case 95: return "APNG frame has another size, raw color mode or PNG color mode than the first frame";
+    case 96: return "APNG frame delay numerator or denominator larger than 65535";
+    case 97: return "finished APNG without frames";
+    case 98: return "APNG frame added to or finishing an already finished animation";
+    case 99: return "band index offset beyond 4 GiB of zlib data, encode without band_rows";
   }
   return "unknown error code";
 }
@@ -6205,6 +7891,37 @@ unsigned encode(std::vector<unsigned char>& out,
   return encode(out, in.empty() ? 0 : &in[0], w, h, state);
 }
 
+Encoder::Encoder()
+{
+  lodepng_arena_init(&arena_);
+}
+
+Encoder::~Encoder()
+{
+  lodepng_arena_cleanup(&arena_);
+}
+
+unsigned Encoder::encode(std::vector<unsigned char>& out, const unsigned char* in, unsigned w, unsigned h)
+{
+  out.clear();
+#ifdef LODEPNG_COMPILE_ALLOCATORS
+  unsigned char* buffer;
+  size_t buffersize;
+  state.arena = &arena_;
+  unsigned error = encodeInArena(&buffer, &buffersize, in, w, h, &state);
+  if(buffer && !error) out.insert(out.end(), &buffer[0], &buffer[buffersize]);
+  return error;
+#else /*LODEPNG_COMPILE_ALLOCATORS*/
+  return lodepng::encode(out, in, w, h, state);
+#endif /*LODEPNG_COMPILE_ALLOCATORS*/
+}
+
+unsigned Encoder::encode(std::vector<unsigned char>& out, const std::vector<unsigned char>& in, unsigned w, unsigned h)
+{
+  if(lodepng_get_raw_size(w, h, &state.info_raw) > in.size()) return 84;
+  return encode(out, in.empty() ? 0 : &in[0], w, h);
+}
+
 #ifdef LODEPNG_COMPILE_DISK
 unsigned encode(const std::string& filename,
                 const unsigned char* in, unsigned w, unsigned h,
@@ -81,6 +81,14 @@ source files with custom allocators.*/
 #endif
 #endif
 
+/*split heavy loops over image data over several threads. Needs C++11 std::thread, so
+it's only available when compiling as C++11 or later; the code is sequential otherwise*/
+#if defined(__cplusplus) && (__cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900))
+#ifndef LODEPNG_NO_COMPILE_THREADS
+#define LODEPNG_COMPILE_THREADS
+#endif
+#endif
+
 #ifdef LODEPNG_COMPILE_CPP
 #include <vector>
 #include <string>
@@ -290,6 +298,9 @@ struct LodePNGCompressSettings /*deflate = compress*/
   unsigned minmatch; /*mininum lz77 length. 3 is normally best, 6 can be better for some PNGs. Default: 0*/
   unsigned nicematch; /*stop searching if >= this length found. Set to 258 for best compression. Default: 128*/
   unsigned lazymatching; /*use lazy matching: better compression but a bit slower. Default: true*/
+  /*choose the deflate blocks from the statistics of the data rather than using fixed size blocks,
+  so the huffman trees adapt where the data changes. Smaller output at about the same speed. Default: true*/
+  unsigned blocksplitting;
 
   /*use custom zlib encoder instead of built in one (default: null)*/
   unsigned (*custom_zlib)(unsigned char**, size_t*,
@@ -529,6 +540,10 @@ typedef struct LodePNGDecoderSettings
   /*store all bytes from unknown chunks in the LodePNGInfo (off by default, useful for a png editor)*/
   unsigned remember_unknown_chunks;
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+
+  /*use the band index that LodePNG writes with LodePNGEncoderSettings::band_rows to inflate and unfilter
+  the bands on multiple threads. Images without one decode as usual. Default: true*/
+  unsigned read_band_index;
 } LodePNGDecoderSettings;
 
 void lodepng_decoder_settings_init(LodePNGDecoderSettings* settings);
@@ -605,6 +620,15 @@ typedef struct LodePNGEncoderSettings
   /*force creating a PLTE chunk if colortype is 2 or 6 (= a suggested palette).
   If colortype is 3, PLTE is _always_ created.*/
   unsigned force_palette;
+
+  /*if not 0, and the image is not interlaced and has more rows than this, compress every band of this
+  many rows separately, each in its own IDAT chunk, and add an "lpIX" chunk with where they start.
+  The result is an ordinary PNG, but LodePNG can decode the bands on multiple threads. If the rows of
+  the raw image and the PNG are whole bytes, the bands are also converted, filtered and compressed on
+  multiple threads, without ever holding the whole filtered image. Costs some compression. Needs the
+  built in zlib compressor, ignored with a custom one. The band offsets are 32-bit, so encoding fails
+  with error 99 if a band would start beyond 4 GiB of compressed data. Default: 0*/
+  unsigned band_rows;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   /*add LodePNG identifier and version as a text chunk, for debugging*/
   unsigned add_id;
@@ -614,6 +638,34 @@ typedef struct LodePNGEncoderSettings
 } LodePNGEncoderSettings;
 
 void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings);
+
+/*
+Bump allocator for the memory the encoder uses internally, see LodePNGState::arena.
+Memory is taken from the heap in large blocks and handed out sequentially. Freeing or growing the
+most recent allocation happens in place, anything else is only given back all at once when the arena
+is reset. Only used with the built in allocators (LODEPNG_COMPILE_ALLOCATORS).
+*/
+typedef struct LodePNGArena
+{
+  size_t blocksize; /*minimum size of the blocks taken from the heap. Default: 1MB*/
+
+  /*statistics since the last reset*/
+  size_t numallocs; /*amount of allocations and reallocations served*/
+  size_t numblocks; /*amount of blocks taken from the heap*/
+  size_t peak; /*maximum amount of bytes allocated at the same time*/
+
+  /*internal*/
+  void* blocks; /*the blocks, most recent first*/
+  size_t inuse; /*amount of bytes currently allocated*/
+} LodePNGArena;
+
+void lodepng_arena_init(LodePNGArena* arena);
+/*Gives all blocks back to the heap.*/
+void lodepng_arena_cleanup(LodePNGArena* arena);
+/*Frees everything allocated from the arena and resets the statistics. If more than one block was needed,
+they are replaced by a single one of their total size, so that the next encode of a similar image
+takes nothing from the heap anymore.*/
+void lodepng_arena_reset(LodePNGArena* arena);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 
@@ -630,6 +682,11 @@ typedef struct LodePNGState
   LodePNGColorMode info_raw; /*specifies the format in which you would like to get the raw pixel buffer*/
   LodePNGInfo info_png; /*info of the PNG image obtained after decoding*/
   unsigned error;
+#ifdef LODEPNG_COMPILE_ENCODER
+  /*if not NULL, lodepng_encode resets this arena and takes all its internal memory from it, only
+  the returned PNG is allocated on the heap. Not owned by the state. Default: NULL*/
+  LodePNGArena* arena;
+#endif /*LODEPNG_COMPILE_ENCODER*/
 #ifdef LODEPNG_COMPILE_CPP
   /* For the lodepng::State subclass. */
   virtual ~LodePNGState(){}
@@ -667,6 +724,48 @@ unsigned lodepng_inspect(unsigned* w, unsigned* h,
 unsigned lodepng_encode(unsigned char** out, size_t* outsize,
                         const unsigned char* image, unsigned w, unsigned h,
                         LodePNGState* state);
+
+/*
+Writes an animated PNG (APNG) one frame at a time. The first frame is stored as the normal
+image, which viewers without APNG support show. Every later frame only stores the rectangle
+that contains the pixels that changed since the frame before it, drawn over that frame.
+*/
+typedef struct LodePNGAnimation
+{
+  unsigned num_plays; /*how many times to play the animation, 0 is forever. Default: 0*/
+
+  /*the APNG file written so far, complete after lodepng_animation_finish. Freed by lodepng_animation_cleanup*/
+  unsigned char* data;
+  size_t size;
+
+  /*the rest is used internally*/
+  size_t allocsize;
+  unsigned w, h;
+  unsigned num_frames;
+  unsigned sequence; /*the sequence number of the next fcTL or fdAT chunk*/
+  size_t actl; /*position of the acTL chunk in data*/
+  unsigned char* previous; /*the last frame added, in the color mode of info_raw*/
+  size_t previoussize;
+  LodePNGColorMode color_raw, color_png; /*info_raw and info_png.color of the first frame*/
+} LodePNGAnimation;
+
+void lodepng_animation_init(LodePNGAnimation* animation);
+void lodepng_animation_cleanup(LodePNGAnimation* animation);
+
+/*
+Adds a frame, shown for delay_num / delay_den seconds (a delay_den of 0 means 100), to the animation.
+All frames must have the same size and the same state->info_raw and state->info_png.color as the
+first frame, or error 95 is returned. They are stored in the color mode of state->info_png.color: auto_convert is not used, since it would only see the
+first frame. The other settings of state are used as for lodepng_encode, and the info_png of
+the first frame, such as its text chunks, is that of the whole file.
+*/
+unsigned lodepng_animation_add(LodePNGAnimation* animation,
+                               const unsigned char* image, unsigned w, unsigned h,
+                               unsigned delay_num, unsigned delay_den,
+                               LodePNGState* state);
+
+/*Ends the file after the last frame was added, animation->data and size are then the complete APNG.*/
+unsigned lodepng_animation_finish(LodePNGAnimation* animation);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 /*
@@ -844,6 +943,35 @@ unsigned encode(std::vector<unsigned char>& out,
 unsigned encode(std::vector<unsigned char>& out,
                 const std::vector<unsigned char>& in, unsigned w, unsigned h,
                 State& state);
+
+/*
+Encoder for a sequence of frames, such as renders of an animation. It keeps the memory used
+for encoding (hash tables, converted and filtered image data, the compressed PNG, ...) in a
+LodePNGArena between frames. Once it has encoded a frame, encoding frames of the same size
+and kind takes no memory from the heap anymore.
+*/
+class Encoder
+{
+  public:
+    Encoder();
+    ~Encoder();
+
+    /*Same as lodepng::encode with a State, but out is overwritten instead of appended to,
+    so that its capacity is reused too.*/
+    unsigned encode(std::vector<unsigned char>& out, const unsigned char* in, unsigned w, unsigned h);
+    unsigned encode(std::vector<unsigned char>& out, const std::vector<unsigned char>& in, unsigned w, unsigned h);
+
+    /*the allocation statistics of the most recent encode*/
+    const LodePNGArena& arena() const { return arena_; }
+
+    State state; /*settings and color modes to use, as for lodepng::encode*/
+
+  private:
+    Encoder(const Encoder&); /*not copyable*/
+    Encoder& operator=(const Encoder&);
+
+    LodePNGArena arena_;
+};
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 #ifdef LODEPNG_COMPILE_DISK
@@ -1175,6 +1303,11 @@ can encode the colors of all pixels without information loss.
 *) force_palette: if colortype is 2 or 6, you can make the encoder write a PLTE
    chunk if force_palette is true. This can used as suggested palette to convert
    to by viewers that don't support more than 256 colors (if those still exist)
+*) band_rows: if not 0, compress the image in bands of this many rows, which
+   the LodePNG decoder can then decode in parallel. Every band starts with a
+   full flush of the deflate stream and its own IDAT chunk, and an "lpIX" chunk
+   stores where the bands start in the zlib data. Other decoders read it as a
+   normal PNG. Only for non-interlaced images.
 *) add_id: add text chunk "Encoder: LodePNG <version>" to the image.
 *) text_compression: default 1. If 1, it'll store texts as zTXt instead of tEXt chunks.
   zTXt chunks use zlib compression on the text. This gives a smaller result on
@@ -1570,6 +1703,7 @@ state.decoder.ignore_crc: ignore CRC checksums
 state.decoder.color_convert: convert internal PNG color to chosen one
 state.decoder.read_text_chunks: whether to read in text metadata chunks
 state.decoder.remember_unknown_chunks: whether to read in unknown chunks
+state.decoder.read_band_index: decode the bands of an "lpIX" chunk in parallel
 state.info_raw.colortype: desired color type for decoded image
 state.info_raw.bitdepth: desired bit depth for decoded image
 state.info_raw....: more color settings, see struct LodePNGColorMode
@@ -1583,11 +1717,13 @@ state.encoder.zlibsettings.windowsize: tweak LZ77 windowsize
 state.encoder.zlibsettings.minmatch: tweak min LZ77 length to match
 state.encoder.zlibsettings.nicematch: tweak LZ77 match where to stop searching
 state.encoder.zlibsettings.lazymatching: try one more LZ77 matching
+state.encoder.zlibsettings.blocksplitting: choose deflate blocks adaptively
 state.encoder.zlibsettings.custom_...: use custom deflate function
 state.encoder.auto_convert: choose optimal PNG color type, if 0 uses info_png
 state.encoder.filter_palette_zero: PNG filter strategy for palette
 state.encoder.filter_strategy: PNG filter strategy to encode with
 state.encoder.force_palette: add palette even if not encoding to one
+state.encoder.band_rows: compress in separately decodable bands of rows
 state.encoder.add_id: add LodePNG identifier and version as a text chunk
 state.encoder.text_compression: use compressed text chunks for metadata
 state.info_raw.colortype: color type of raw input image you provide
@@ -3,15 +3,149 @@
 
 #include <vector>
 #include <string.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <stdexcept>
 #include <cmath>
+#include <chrono>
+#include <algorithm>
+#include <thread>
+#include <string>
 
 #include "lodepng.h" //Used for png encoding.
+#include "convert.h" //Used to convert the rendered floats to integer samples.
+#include "reference.h" //Used to verify the rendered image.
+#include "metrics.h" //Used to count the work done.
+
+#ifdef EMBEDDED_SHADERS
+// The SPIR-V of the shaders, compiled and written as constexpr arrays by CMakeLists.txt.
+#include "comp_spv.h"
+#include "comp_palette_spv.h"
+#include "comp_mask_spv.h"
+#include "comp_persistent_spv.h"
+#include "comp_persistent_clock_spv.h"
+#include "comp_stats_spv.h"
+#endif
 
 const int WIDTH = 3200; // Size of rendered mandelbrot set.
 const int HEIGHT = 2400; // Size of renderered mandelbrot set.
 const int WORKGROUP_SIZE = 32; // Workgroup size in compute shader.
+const int MAX_ITERATIONS = 128; // Iteration limit M of the mandelbrot loop in the compute shaders.
+const int PALETTE_PIXELS_PER_INVOCATION = 4; // Pixels rendered by one invocation of shader_palette.comp.
+const int READBACK_CHUNK_ROWS = 64; // Rows read back at a time when streaming the image to a file.
+const int MASK_WORDS = WIDTH * HEIGHT / 32; // 32-bit words of the mask rendered by shader_mask.comp.
+const int MAX_BOUNDARY_POINTS = 1 << 20; // Room for boundary pixel coordinates behind the mask.
+const int MAX_SUBGROUP_SIZE = 128; // Ballots in the shaders are a uvec4, so subgroups can't be larger.
+/*
+Workgroups dispatched for the persistent threads and the tiles of shader_persistent.comp, unless
+--workgroups says otherwise. 64 workgroups of 1024 invocations is about what a current desktop GPU
+runs at once. Vulkan can't tell how many it really keeps resident; if the load balance printed
+after rendering shows workgroups that got no work, fewer would do.
+*/
+const int RESIDENT_WORKGROUPS = 64;
+
+/*
+The formats the compute shader can write the rendered image in.
+*/
+enum OutputFormat {
+    OUTPUT_RGBA32F,  // a vec4 of floats per pixel, rendered by shader.comp.
+    OUTPUT_PALETTE8, // an 8-bit palette index per pixel, rendered by shader_palette.comp.
+    OUTPUT_MASK1,    // a bit per pixel that is set inside the set, rendered by shader_mask.comp.
+};
+
+/*
+The file formats an OUTPUT_RGBA32F image can be saved in. OUTPUT_PALETTE8 is always
+saved as a palette png, since it has no more than 8 bits of precision to begin with,
+and OUTPUT_MASK1 as a 1-bit greyscale png.
+*/
+enum SaveFormat {
+    SAVE_PNG8,  // mandelbrot.png with 8 bits per channel.
+    SAVE_PNG16, // mandelbrot.png with 16 bits per channel.
+    SAVE_PFM,   // mandelbrot.pfm with the rendered floats as they are.
+};
+
+/*
+The conversions the rendered image can be read back with.
+*/
+enum Conversion {
+    CONVERT_NONE,   // the bytes of the buffer as they are, floats, palette indices or mask words.
+    CONVERT_RGBA8,  // 8-bit RGBA, the raw image data of an 8-bit png. Needs OUTPUT_RGBA32F.
+    CONVERT_RGBA16, // 16-bit big endian RGBA, the raw image data of a 16-bit png. Needs OUTPUT_RGBA32F.
+    CONVERT_RGB32F, // the floats without alpha, as in a pfm file. Needs OUTPUT_RGBA32F.
+    CONVERT_GREY1,  // 1-bit greyscale, white inside the set, the raw image data of a 1-bit png. Needs OUTPUT_MASK1.
+};
+
+/*
+How shader_persistent.comp assigns pixels to invocations, its push constant `schedule`.
+*/
+enum Schedule {
+    SCHEDULE_2D = 0,         // every invocation renders the pixel at its ID, like shader.comp.
+    SCHEDULE_PERSISTENT = 1, // a few resident workgroups take pixels from a queue until all are done.
+    SCHEDULE_TILES = 2,      // a few resident workgroups take the tiles of SCHEDULE_2D from a queue.
+};
+
+const char* const SCHEDULE_NAMES[] = { "2d dispatch", "persistent threads", "tiles" };
+
+// What shader.comp did, added up over all its workgroups, when compiled with its statistics (comp_stats.spv).
+struct KernelStatistics {
+    uint32_t iterations; // of all pixels, counted as METRIC_KERNEL_ITERATIONS describes.
+    uint32_t interiorPixels; // the pixels that did MAX_ITERATIONS iterations, the rest escaped.
+};
+
+// What a workgroup of shader_persistent.comp did, its `stats` entry.
+struct WorkgroupStats {
+    uint32_t tiles;
+    uint32_t iterations;
+    uint32_t start[2], end[2]; // the subgroup clock before and after, low word first, with comp_persistent_clock.spv.
+};
+
+/*
+A view of the mandelbrot set: pixel (x, y) shows the point center + (x / WIDTH - 0.5, y / HEIGHT - 0.5) * scale.
+*/
+struct View {
+    const char* name;
+    float centerX, centerY;
+    float scale;
+};
+
+// The view shader.comp renders.
+const View DEFAULT_VIEW = { "default", -0.445f, 0.0f, 2.34f };
+
+// The push constants of shader_persistent.comp.
+struct ViewPushConstants {
+    float center[2];
+    float scale;
+    uint32_t schedule;
+};
+
+/*
+What the application renders and how it saves it.
+*/
+struct Options {
+    OutputFormat format;
+    SaveFormat save; // the file format an OUTPUT_RGBA32F image is saved in.
+    bool benchmarkSave; // save in every SaveFormat and time them.
+    bool boundary; // let OUTPUT_MASK1 also list the boundary pixels.
+    Schedule schedule; // anything but SCHEDULE_2D renders OUTPUT_RGBA32F with shader_persistent.comp.
+    int workgroups; // the workgroups SCHEDULE_PERSISTENT and SCHEDULE_TILES dispatch.
+    bool benchmarkKernels; // time the schedules of shader_persistent.comp on a few views.
+    bool tiledLayout; // store OUTPUT_RGBA32F as WORKGROUP_SIZE x WORKGROUP_SIZE tiles, see shader.comp.
+    bool verify; // compare every rendered image with the CPU reference of reference.h.
+    const char* metricsFile; // if not NULL, write the counters of metrics.h there when done.
+    bool statistics; // let shader.comp add up the iterations it does, see KernelStatistics.
+
+    Options()
+        : format(OUTPUT_RGBA32F), save(SAVE_PNG8), benchmarkSave(false), boundary(false),
+          schedule(SCHEDULE_2D), workgroups(RESIDENT_WORKGROUPS), benchmarkKernels(false), tiledLayout(false),
+          verify(false), metricsFile(NULL), statistics(false) {}
+};
+
+/*
+Receives the rendered image from ComputeApplication::readBackRows a chunk at a time: numRows
+rows of rowBytes bytes each, the first of which is row firstRow of the image. rows is only
+valid until the sink returns.
+*/
+typedef void (*RowSink)(void* user, const unsigned char* rows, size_t rowBytes, int firstRow, int numRows);
 
 #ifdef NDEBUG
 const bool enableValidationLayers = false;
@@ -98,6 +232,35 @@ private:
         
     uint32_t bufferSize; // size of `buffer` in bytes.
 
+    /*
+    The queues of shader_persistent.comp: the index of the next pixel and of the next tile to render,
+    which the command buffer sets to 0 before every dispatch.
+    */
+    VkBuffer workBuffer;
+    VkDeviceMemory workBufferMemory;
+
+    /*
+    The WorkgroupStats every workgroup of shader_persistent.comp writes, room for
+    `statsCount` of them.
+    */
+    VkBuffer statsBuffer;
+    VkDeviceMemory statsBufferMemory;
+    uint32_t statsCount;
+
+    /*
+    The KernelStatistics shader.comp adds its workgroups to, with collectStatistics.
+    The command buffer zeroes it before every dispatch.
+    */
+    VkBuffer statisticsBuffer;
+    VkDeviceMemory statisticsBufferMemory;
+
+    /*
+    Timestamps written before and after the dispatch, to time the kernels on the GPU.
+    Only created when benchmarking them.
+    */
+    VkQueryPool queryPool;
+    uint32_t timestampValidBits; // the bits of the timestamps of `queue` that count.
+
     std::vector<const char *> enabledLayers;
 
     /*
@@ -120,56 +283,677 @@ private:
     */
     uint32_t queueFamilyIndex;
 
+    OutputFormat outputFormat; // the format `buffer` is rendered in.
+    SaveFormat saveFormat; // the file format an OUTPUT_RGBA32F image is saved in.
+    bool benchmarkSave; // whether to save in every SaveFormat and time them.
+    bool collectBoundary; // whether OUTPUT_MASK1 also lists the boundary pixels.
+    Schedule schedule; // how shader_persistent.comp renders the image, SCHEDULE_2D renders it with shader.comp.
+    uint32_t residentWorkgroups; // the workgroups dispatched for SCHEDULE_PERSISTENT and SCHEDULE_TILES.
+    bool benchmarkKernels; // whether to time the schedules of shader_persistent.comp first.
+    bool tiledLayout; // whether `buffer` holds tiles instead of rows, which readBack puts back into rows.
+    bool verify; // whether to compare the rendered images with the CPU reference.
+    bool verificationFailed; // whether a rendered image differed from the reference in too many pixels.
+    const char* metricsFile; // where to write the counters of metrics.h when done, or NULL.
+    bool collectStatistics; // whether shader.comp adds up its work in `statisticsBuffer`.
+    bool shaderClock; // whether the device has VK_KHR_shader_clock, so comp_persistent_clock.spv times the workgroups.
+    KernelStatistics statistics; // of the last frame rendered with collectStatistics.
+
+    /*
+    The png encoder. It keeps its working memory between frames, so saving
+    further frames of the same size does not allocate again.
+    */
+    lodepng::Encoder encoder;
+    std::vector<unsigned char> png; // the most recently encoded png file.
+
+    std::vector<unsigned char> image; // the rendered image converted for the png encoder.
+    std::vector<unsigned char> rowChunk; // room for READBACK_CHUNK_ROWS converted rows.
+    size_t savedBytes; // the size of the file last written by writeImage.
+
 public:
+    ComputeApplication(const Options& options = Options())
+        : workBuffer(VK_NULL_HANDLE), workBufferMemory(VK_NULL_HANDLE), statsBuffer(VK_NULL_HANDLE),
+          statsBufferMemory(VK_NULL_HANDLE), statsCount(0), statisticsBuffer(VK_NULL_HANDLE),
+          statisticsBufferMemory(VK_NULL_HANDLE), queryPool(VK_NULL_HANDLE),
+          outputFormat(options.format), saveFormat(options.save), benchmarkSave(options.benchmarkSave),
+          collectBoundary(options.boundary), schedule(options.schedule), residentWorkgroups(options.workgroups),
+          benchmarkKernels(options.benchmarkKernels), tiledLayout(options.tiledLayout),
+          verify(options.verify), verificationFailed(false), metricsFile(options.metricsFile),
+          collectStatistics(options.statistics), shaderClock(false), savedBytes(0) {
+        if (collectBoundary && outputFormat != OUTPUT_MASK1) {
+            throw std::runtime_error("the boundary can only be collected with the mask output");
+        }
+        if (usesViewKernel() && outputFormat != OUTPUT_RGBA32F) {
+            throw std::runtime_error("shader_persistent.comp only renders the float output");
+        }
+        if (options.workgroups < 1) {
+            throw std::runtime_error("at least one workgroup has to be dispatched");
+        }
+        if (tiledLayout && outputFormat != OUTPUT_RGBA32F) {
+            throw std::runtime_error("only the float output can be stored as tiles");
+        }
+        if (collectStatistics && (outputFormat != OUTPUT_RGBA32F || usesViewKernel())) {
+            throw std::runtime_error("only shader.comp collects statistics");
+        }
+        statistics.iterations = statistics.interiorPixels = 0;
+        /*
+        Compress the png in bands of 64 rows that lodepng can decode on all cores,
+        which is what the tools comparing renders against references spend most of their time on.
+        Other png readers see an ordinary png that is about 0.2% larger.
+        The bands are also filtered and compressed on all cores, which makes encoding several times faster.
+        */
+        encoder.state.encoder.band_rows = 64;
+    }
+
     void run() {
         // Buffer size of the storage buffer that will contain the rendered mandelbrot set.
-        bufferSize = sizeof(Pixel) * WIDTH * HEIGHT;
+        if (outputFormat == OUTPUT_PALETTE8) {
+            bufferSize = sizeof(unsigned char) * WIDTH * HEIGHT;
+        } else if (outputFormat == OUTPUT_MASK1) {
+            // The mask, then the boundary count, padded to the 8 byte alignment of the uvec2 coordinates after it.
+            bufferSize = sizeof(uint32_t) * MASK_WORDS + 2 * sizeof(uint32_t);
+            if (collectBoundary) {
+                bufferSize += 2 * sizeof(uint32_t) * MAX_BOUNDARY_POINTS;
+            }
+        } else {
+            bufferSize = sizeof(Pixel) * WIDTH * HEIGHT;
+        }
 
         // Initialize vulkan:
         createInstance();
         findPhysicalDevice();
+        if (outputFormat == OUTPUT_MASK1) {
+            checkSubgroupSupport(VK_SUBGROUP_FEATURE_BASIC_BIT | VK_SUBGROUP_FEATURE_BALLOT_BIT);
+        } else if (usesViewKernel()) {
+            checkSubgroupSupport(VK_SUBGROUP_FEATURE_BASIC_BIT | VK_SUBGROUP_FEATURE_BALLOT_BIT | VK_SUBGROUP_FEATURE_VOTE_BIT);
+            shaderClock = supportsShaderClock();
+        } else if (collectStatistics) {
+            checkSubgroupSupport(VK_SUBGROUP_FEATURE_BASIC_BIT | VK_SUBGROUP_FEATURE_ARITHMETIC_BIT);
+        }
         createDevice();
         createBuffer();
+        if (usesViewKernel()) {
+            createWorkBuffers();
+        }
+        if (collectStatistics) {
+            /*
+            Only one invocation of every workgroup adds to it, and the host reads it with the image,
+            so it is host visible like `buffer`. vkCmdFillBuffer zeroes it, so it's a transfer destination.
+            */
+            createStorageBuffer(sizeof(KernelStatistics), VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
+                statisticsBuffer, statisticsBufferMemory);
+        }
         createDescriptorSetLayout();
         createDescriptorSet();
         createComputePipeline();
         createCommandBuffer();
 
+        if (benchmarkKernels) {
+            createQueryPool();
+            benchmarkSchedules();
+            // The benchmark recorded its own commands, so record the ones for the image to save again.
+            recordCommandBuffer(DEFAULT_VIEW, schedule);
+        }
+
         // Finally, run the recorded command buffer.
         runCommandBuffer();
+        if (schedule != SCHEDULE_2D) {
+            printLoadBalance(schedule);
+        }
+        if (collectStatistics) {
+            readStatistics();
+        }
 
         // The former command rendered a mandelbrot set to a buffer.
         // Save that buffer as a png on disk.
         saveRenderedImage();
 
+        if (verify) {
+            std::vector<unsigned char> reference = renderReferenceIterations(WIDTH, HEIGHT,
+                DEFAULT_VIEW.centerX, DEFAULT_VIEW.centerY, DEFAULT_VIEW.scale);
+            verifyRenderedImage(reference, DEFAULT_VIEW.name);
+        }
+
         // Clean up all vulkan resources.
         cleanup();
+
+        if (metricsFile && !writeMetricsPrometheus(metricsFile, "vulkan_minimal_compute_")) {
+            printf("could not write %s\n", metricsFile);
+        }
+
+        // Only fail now, so that the vulkan resources are cleaned up either way.
+        if (verificationFailed) {
+            throw std::runtime_error("the rendered image doesn't match the reference");
+        }
     }
 
-    void saveRenderedImage() {
+    // Whether the image is rendered with shader_persistent.comp, which takes the view as push constants.
+    bool usesViewKernel() const {
+        return schedule != SCHEDULE_2D || benchmarkKernels;
+    }
+
+    // The storage buffers the compute shader binds.
+    uint32_t bindingCount() const {
+        return usesViewKernel() ? 3 : collectStatistics ? 2 : 1;
+    }
+
+    /*
+    Reads the KernelStatistics of the last frame into `statistics`, adds them to the counters of metrics.h,
+    and prints them: how many iterations a pixel took on average, and how many of the pixels hit
+    the iteration limit, which are the ones that cost the most.
+    */
+    void readStatistics() {
+        static_assert((uint64_t)WIDTH * HEIGHT * MAX_ITERATIONS <= 0xFFFFFFFFu, "the iterations must fit in 32 bits");
+        void* mappedMemory = NULL;
+        VK_CHECK_RESULT(vkMapMemory(device, statisticsBufferMemory, 0, sizeof(KernelStatistics), 0, &mappedMemory));
+        statistics = *(const KernelStatistics*)mappedMemory;
+        vkUnmapMemory(device, statisticsBufferMemory);
+
+        const uint32_t pixels = WIDTH * HEIGHT;
+        uint32_t escaped = pixels - statistics.interiorPixels;
+        metricsAdd(METRIC_KERNEL_ITERATIONS, statistics.iterations);
+        metricsAdd(METRIC_ESCAPED_PIXELS, escaped);
+        metricsAdd(METRIC_INTERIOR_PIXELS, statistics.interiorPixels);
+        printf("%u iterations, %.2f per pixel, %u pixels escaped, %u interior, %.2f%% hit the limit of %d\n",
+            statistics.iterations, double(statistics.iterations) / pixels, escaped, statistics.interiorPixels,
+            100.0 * statistics.interiorPixels / pixels, MAX_ITERATIONS);
+    }
+
+    // The number of workgroups recordCommandBuffer dispatches for the float output with `schedule`.
+    uint32_t workgroupsOf(Schedule schedule) const {
+        if (schedule != SCHEDULE_2D) {
+            return residentWorkgroups; // the workgroups take the pixels or tiles from a queue, wherever they are.
+        }
+        return (uint32_t)ceil(WIDTH / float(WORKGROUP_SIZE)) * (uint32_t)ceil(HEIGHT / float(WORKGROUP_SIZE));
+    }
+
+    /*
+    Prints how the work of the last dispatch of shader_persistent.comp with `schedule` was spread over its
+    workgroups: how long the slowest workgroup ran compared to the mean, from the clocks it read with
+    shaderClock. Without VK_KHR_shader_clock, the iterations the busiest workgroup did are compared to
+    the mean instead. Those are only an estimate: a workgroup also waits for its slowest lane and for the
+    queue, which isn't counted.
+    */
+    void printLoadBalance(Schedule schedule) {
+        uint32_t workgroups = workgroupsOf(schedule);
+        void* mappedMemory = NULL;
+        VK_CHECK_RESULT(vkMapMemory(device, statsBufferMemory, 0, sizeof(WorkgroupStats) * workgroups, 0, &mappedMemory));
+        const WorkgroupStats* stats = (const WorkgroupStats*)mappedMemory;
+
+        uint64_t totalIterations = 0, totalClocks = 0, maxClocks = 0;
+        uint32_t maxIterations = 0, minTiles = stats[0].tiles, maxTiles = 0, idle = 0;
+        for (uint32_t i = 0; i < workgroups; ++i) {
+            totalIterations += stats[i].iterations;
+            maxIterations = std::max(maxIterations, stats[i].iterations);
+            minTiles = std::min(minTiles, stats[i].tiles);
+            maxTiles = std::max(maxTiles, stats[i].tiles);
+            if (stats[i].iterations == 0) ++idle;
+            uint64_t start = stats[i].start[0] | (uint64_t)stats[i].start[1] << 32;
+            uint64_t end = stats[i].end[0] | (uint64_t)stats[i].end[1] << 32;
+            totalClocks += end - start; // unsigned, so a clock that wrapped around in between still gives the duration.
+            maxClocks = std::max(maxClocks, end - start);
+        }
+        vkUnmapMemory(device, statsBufferMemory);
+
+        if (shaderClock) {
+            double meanClocks = double(totalClocks) / workgroups;
+            printf("  %-18s %u workgroups, %u idle, %u to %u tiles each, time max/mean %.2f\n", SCHEDULE_NAMES[schedule],
+                workgroups, idle, minTiles, maxTiles, meanClocks > 0 ? maxClocks / meanClocks : 0.0);
+        } else {
+            double meanIterations = double(totalIterations) / workgroups;
+            printf("  %-18s %u workgroups, %u idle, %u to %u tiles each, iteration count max/mean %.2f (not time)\n", SCHEDULE_NAMES[schedule],
+                workgroups, idle, minTiles, maxTiles, meanIterations > 0 ? maxIterations / meanIterations : 0.0);
+        }
+    }
+
+    /*
+    Renders a few views with every schedule of shader_persistent.comp, and prints the best
+    time the GPU took for each, and how evenly the workgroups were loaded. Near the boundary of the set,
+    neighbouring pixels need very different numbers of iterations, so the zoomed in views show what
+    the persistent threads and the tiles gain.
+    */
+    void benchmarkSchedules() {
+        const View views[] = {
+            DEFAULT_VIEW,
+            { "seahorse valley", -0.7453f, 0.1127f, 0.0065f },
+            { "elephant valley", 0.2823f, 0.0101f, 0.01f },
+        };
+        const int runs = 5;
+
+        for (size_t v = 0; v < sizeof(views) / sizeof(views[0]); ++v) {
+            printf("%s:\n", views[v].name);
+            std::vector<unsigned char> reference;
+            if (verify) {
+                reference = renderReferenceIterations(WIDTH, HEIGHT, views[v].centerX, views[v].centerY, views[v].scale);
+            }
+            double best[3] = { 1e30, 1e30, 1e30 };
+            for (int schedule = SCHEDULE_2D; schedule <= SCHEDULE_TILES; ++schedule) {
+                recordCommandBuffer(views[v], (Schedule)schedule);
+                for (int run = 0; run < runs; ++run) {
+                    runCommandBuffer();
+                    best[schedule] = std::min(best[schedule], readDispatchMilliseconds());
+                }
+                printf("  %-18s %8.2f ms, speedup %.2fx\n", SCHEDULE_NAMES[schedule], best[schedule], best[SCHEDULE_2D] / best[schedule]);
+                printLoadBalance((Schedule)schedule);
+                if (verify) {
+                    verifyRenderedImage(reference, SCHEDULE_NAMES[schedule]);
+                }
+            }
+        }
+    }
+
+    // The time between the timestamps the command buffer wrote around the dispatch, in milliseconds.
+    double readDispatchMilliseconds() {
+        uint64_t timestamps[2];
+        VK_CHECK_RESULT(vkGetQueryPoolResults(device, queryPool, 0, 2, sizeof(timestamps), timestamps, sizeof(uint64_t),
+            VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+        uint64_t mask = timestampValidBits >= 64 ? ~0ull : (1ull << timestampValidBits) - 1;
+        uint64_t ticks = (timestamps[1] - timestamps[0]) & mask;
+
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+        return ticks * double(properties.limits.timestampPeriod) / 1e6;
+    }
+
+    /*
+    The palette used by shader_palette.comp. Entry n is the color shader.comp gives to a pixel
+    that did n iterations, so both output formats give the same image.
+    */
+    static void makePalette(LodePNGColorMode* mode) {
+        lodepng_palette_clear(mode);
+        for (int n = 0; n <= MAX_ITERATIONS; ++n) {
+            float color[3];
+            referenceColor(n, color);
+            unsigned char rgb[3];
+            for (int c = 0; c < 3; ++c) {
+                rgb[c] = (unsigned char)(255.0f * color[c]);
+            }
+            lodepng_palette_add(mode, rgb[0], rgb[1], rgb[2], 255);
+        }
+        mode->colortype = LCT_PALETTE;
+        mode->bitdepth = 8;
+    }
+
+    // The size in bytes of one row of the rendered image after `conversion`.
+    size_t rowBytes(Conversion conversion) const {
+        switch (conversion) {
+        case CONVERT_RGBA8: return WIDTH * 4;
+        case CONVERT_RGBA16: return WIDTH * 8;
+        case CONVERT_RGB32F: return WIDTH * 3 * sizeof(float);
+        case CONVERT_GREY1: return WIDTH / 8;
+        default: break;
+        }
+        switch (outputFormat) {
+        case OUTPUT_PALETTE8: return WIDTH;
+        case OUTPUT_MASK1: return WIDTH / 8;
+        default: return sizeof(Pixel) * WIDTH;
+        }
+    }
+
+    // Throws if the rendered image can't be read back with `conversion`.
+    void checkConversion(Conversion conversion) const {
+        if (conversion == CONVERT_GREY1 ? outputFormat != OUTPUT_MASK1
+                                        : conversion != CONVERT_NONE && outputFormat != OUTPUT_RGBA32F) {
+            throw std::runtime_error("the rendered image can't be read back with this conversion");
+        }
+    }
+
+    // Converts `count` pixels of the float output, which follow each other in `buffer`.
+    static void convertPixels(Conversion conversion, const Pixel* pixels, int count, unsigned char* out) {
+        if (conversion == CONVERT_NONE) {
+            memcpy(out, pixels, sizeof(Pixel) * count);
+        } else if (conversion == CONVERT_RGBA8) {
+            floatsToUint8(out, &pixels[0].r, count * 4);
+        } else if (conversion == CONVERT_RGBA16) {
+            floatsToUint16BE(out, &pixels[0].r, count * 4);
+        } else {
+            for (int x = 0; x < count; ++x) {
+                memcpy(out + x * 3 * sizeof(float), &pixels[x].r, 3 * sizeof(float));
+            }
+        }
+    }
+
+    /*
+    Converts numRows rows of the mapped buffer memory, starting at row y and going down, or up with bottomUp.
+    With tiledLayout, a row is put together from the rows of WIDTH / WORKGROUP_SIZE tiles while converting it,
+    so the conversion reads every tile row once, as it would the rows of the linear layout.
+    */
+    void convertRows(Conversion conversion, const unsigned char* mapped, int y, int numRows, bool bottomUp, unsigned char* out) const {
+        size_t inBytes = rowBytes(CONVERT_NONE);
+        size_t outBytes = rowBytes(conversion);
+        for (int i = 0; i < numRows; ++i, out += outBytes) {
+            int row = bottomUp ? y - i : y + i;
+            const unsigned char* in = mapped + inBytes * row;
+            if (tiledLayout) {
+                static_assert(WIDTH % WORKGROUP_SIZE == 0 && HEIGHT % WORKGROUP_SIZE == 0, "the tiles must cover the image exactly");
+                const int tilePixels = WORKGROUP_SIZE * WORKGROUP_SIZE;
+                const Pixel* tileRow = (const Pixel*)mapped + (row / WORKGROUP_SIZE) * WIDTH * WORKGROUP_SIZE +
+                                       (row % WORKGROUP_SIZE) * WORKGROUP_SIZE;
+                for (int tile = 0; tile < WIDTH / WORKGROUP_SIZE; ++tile) {
+                    convertPixels(conversion, tileRow + tile * tilePixels, WORKGROUP_SIZE,
+                        out + tile * (outBytes / (WIDTH / WORKGROUP_SIZE)));
+                }
+            } else if (conversion == CONVERT_GREY1) {
+                // Pixel x is bit x % 32 of a word, but png wants the first pixel in the highest bit of every byte.
+                const uint32_t* words = (const uint32_t*)in;
+                for (int i = 0; i < WIDTH / 8; ++i) {
+                    unsigned char bits = (unsigned char)(words[i / 4] >> (8 * (i % 4)));
+                    bits = (unsigned char)((bits & 0xF0) >> 4 | (bits & 0x0F) << 4);
+                    bits = (unsigned char)((bits & 0xCC) >> 2 | (bits & 0x33) << 2);
+                    out[i] = (unsigned char)((bits & 0xAA) >> 1 | (bits & 0x55) << 1);
+                }
+            } else if (outputFormat == OUTPUT_RGBA32F) {
+                convertPixels(conversion, (const Pixel*)in, WIDTH, out);
+            } else {
+                memcpy(out, in, outBytes);
+            }
+        }
+    }
+
+    /*
+    Reads the rendered image back from the GPU, converted, in chunks of at most chunkRows rows.
+    Every chunk is converted into scratch, which must hold chunkRows * rowBytes(conversion) bytes,
+    and then given to sink. With bottomUp, the chunks and their rows go from the last row of the
+    image to the first, as pfm stores them.
+    Nothing but scratch is used to hold pixels, and nothing is allocated, so the memory this takes
+    is chosen and reused by the caller.
+    */
+    void readBackRows(Conversion conversion, bool bottomUp, unsigned char* scratch, int chunkRows, RowSink sink, void* user) {
+        checkConversion(conversion);
+        if (chunkRows <= 0) {
+            throw std::runtime_error("chunkRows must be positive");
+        }
+
         void* mappedMemory = NULL;
         // Map the buffer memory, so that we can read from it on the CPU.
-        vkMapMemory(device, bufferMemory, 0, bufferSize, 0, &mappedMemory);
-        Pixel* pmappedMemory = (Pixel *)mappedMemory;
-
-        // Get the color data from the buffer, and cast it to bytes.
-        // We save the data to a vector.
-        std::vector<unsigned char> image;
-        image.reserve(WIDTH * HEIGHT * 4);
-        for (int i = 0; i < WIDTH*HEIGHT; i += 1) {
-            image.push_back((unsigned char)(255.0f * (pmappedMemory[i].r)));
-            image.push_back((unsigned char)(255.0f * (pmappedMemory[i].g)));
-            image.push_back((unsigned char)(255.0f * (pmappedMemory[i].b)));
-            image.push_back((unsigned char)(255.0f * (pmappedMemory[i].a)));
+        VK_CHECK_RESULT(vkMapMemory(device, bufferMemory, 0, bufferSize, 0, &mappedMemory));
+
+        for (int done = 0; done < HEIGHT; done += chunkRows) {
+            int numRows = std::min(chunkRows, HEIGHT - done);
+            int y = bottomUp ? HEIGHT - 1 - done : done; // the first row of this chunk.
+            convertRows(conversion, (const unsigned char*)mappedMemory, y, numRows, bottomUp, scratch);
+            sink(user, scratch, rowBytes(conversion), y, numRows);
         }
+        metricsAdd(METRIC_READBACK_BYTES, (uint64_t)HEIGHT * rowBytes(CONVERT_NONE));
+
         // Done reading, so unmap.
         vkUnmapMemory(device, bufferMemory);
+    }
+
+    /*
+    Reads the whole rendered image back from the GPU, converted, into out,
+    which must hold HEIGHT * rowBytes(conversion) bytes.
+    The image is cut into a band of rows per core, and the bands are converted at the same time,
+    since one core can't keep up with the memory bandwidth.
+    */
+    void readBack(Conversion conversion, bool bottomUp, unsigned char* out) {
+        checkConversion(conversion);
+
+        void* mappedMemory = NULL;
+        VK_CHECK_RESULT(vkMapMemory(device, bufferMemory, 0, bufferSize, 0, &mappedMemory));
+        const unsigned char* mapped = (const unsigned char*)mappedMemory;
+
+        int numBands = std::max(1, std::min((int)std::thread::hardware_concurrency(), HEIGHT / READBACK_CHUNK_ROWS));
+        size_t outBytes = rowBytes(conversion);
+        std::vector<std::thread> threads;
+        for (int band = 1; band < numBands; ++band) {
+            int begin = HEIGHT * band / numBands;
+            int end = HEIGHT * (band + 1) / numBands;
+            threads.push_back(std::thread(&ComputeApplication::convertRows, this, conversion, mapped,
+                bottomUp ? HEIGHT - 1 - begin : begin, end - begin, bottomUp, out + begin * outBytes));
+        }
+        // This thread does the first band.
+        convertRows(conversion, mapped, bottomUp ? HEIGHT - 1 : 0, HEIGHT / numBands, bottomUp, out);
+        for (size_t i = 0; i < threads.size(); ++i) {
+            threads[i].join();
+        }
+        metricsAdd(METRIC_READBACK_BYTES, (uint64_t)HEIGHT * rowBytes(CONVERT_NONE));
+
+        vkUnmapMemory(device, bufferMemory);
+    }
+
+    // A RowSink that appends the rows to the FILE* user.
+    static void writeRowsToFile(void* user, const unsigned char* rows, size_t rowBytes, int, int numRows) {
+        fwrite(rows, rowBytes, numRows, (FILE*)user);
+    }
+
+    /*
+    Saves the floats as they are to mandelbrot.pfm. pfm only knows greyscale and RGB, so alpha
+    is left out. The rows go from the bottom to the top, and a negative scale in the header
+    means the floats are little endian.
+    The file is written straight from the buffer a chunk of rows at a time, so this needs no
+    more memory than `rowChunk` rather than the size of the file.
+    Returns 0, or 79 like lodepng::save_file if the file can't be written.
+    */
+    unsigned savePfm() {
+        FILE* file = fopen("mandelbrot.pfm", "wb");
+        if (!file) return 79;
+
+        const uint16_t endianTest = 1;
+        bool littleEndian = *(const unsigned char*)&endianTest == 1;
+        int headerSize = fprintf(file, "PF\n%d %d\n%s\n", WIDTH, HEIGHT, littleEndian ? "-1.0" : "1.0");
+        savedBytes = headerSize + HEIGHT * rowBytes(CONVERT_RGB32F);
+
+        rowChunk.resize(READBACK_CHUNK_ROWS * rowBytes(CONVERT_RGB32F));
+        readBackRows(CONVERT_RGB32F, true, rowChunk.data(), READBACK_CHUNK_ROWS, writeRowsToFile, file);
+
+        bool failed = ferror(file) != 0;
+        if (fclose(file) != 0) failed = true;
+        return failed ? 79 : 0;
+    }
+
+    /*
+    Reads the rendered image back to `image`, in the form `format` needs. The buffer
+    is kept, so this only allocates the first time. pfm is streamed instead, see savePfm.
+    */
+    void convertImage(SaveFormat format) {
+        if (format == SAVE_PFM) return;
+        Conversion conversion = format == SAVE_PNG16 ? CONVERT_RGBA16 : CONVERT_RGBA8;
+        image.resize(HEIGHT * rowBytes(conversion));
+        readBack(conversion, false, image.data());
+    }
+
+    /*
+    Encodes `image` if needed, and writes it to the file of `format`.
+    Returns 0 or a lodepng error code.
+    */
+    unsigned writeImage(SaveFormat format) {
+        if (format == SAVE_PFM) {
+            return savePfm();
+        }
+
+        // The encoder is shared with the other formats, so always say what image is given to it.
+        encoder.state.info_raw.colortype = LCT_RGBA;
+        encoder.state.info_raw.bitdepth = format == SAVE_PNG16 ? 16 : 8;
+        encoder.state.info_png.color.bitdepth = encoder.state.info_raw.bitdepth;
+        unsigned error = encoder.encode(png, image, WIDTH, HEIGHT);
+        if (!error) error = lodepng::save_file(png, "mandelbrot.png");
+        savedBytes = png.size();
+        return error;
+    }
+
+    /*
+    Saves the image in every SaveFormat a few times, and prints the best time of
+    reading back and converting the floats and of encoding and writing the file for each of them.
+    pfm does both at once. Throughput is given in megabytes of rendered floats per second.
+    */
+    void benchmarkSaveFormats() {
+        const char* names[] = { "png8", "png16", "pfm" };
+        const int runs = 3;
+        double megabytes = double(sizeof(Pixel) * WIDTH * HEIGHT) / 1e6;
+
+        for (int format = SAVE_PNG8; format <= SAVE_PFM; ++format) {
+            double convertTime = 1e30, writeTime = 1e30;
+            for (int run = 0; run < runs; ++run) {
+                auto t0 = std::chrono::steady_clock::now();
+                convertImage((SaveFormat)format);
+                auto t1 = std::chrono::steady_clock::now();
+                unsigned error = writeImage((SaveFormat)format);
+                auto t2 = std::chrono::steady_clock::now();
+                if (error) {
+                    printf("%s: error %d: %s\n", names[format], error, lodepng_error_text(error));
+                    return;
+                }
+                convertTime = std::min(convertTime, std::chrono::duration<double>(t1 - t0).count());
+                writeTime = std::min(writeTime, std::chrono::duration<double>(t2 - t1).count());
+            }
+            size_t fileSize = savedBytes;
+            if (format == SAVE_PFM) {
+                printf("%-5s convert       -                     encode+write %7.1f ms (%7.0f MB/s)  file %9zu bytes\n",
+                    names[format], writeTime * 1e3, megabytes / writeTime, fileSize);
+            } else {
+                printf("%-5s convert %7.1f ms (%7.0f MB/s)  encode+write %7.1f ms (%7.0f MB/s)  file %9zu bytes\n",
+                    names[format], convertTime * 1e3, megabytes / convertTime,
+                    writeTime * 1e3, megabytes / writeTime, fileSize);
+            }
+        }
+    }
+
+    // Saves the mask as a 1-bit greyscale mandelbrot.png, white inside the set.
+    void saveMask() {
+        image.resize(HEIGHT * rowBytes(CONVERT_GREY1));
+        readBack(CONVERT_GREY1, false, image.data());
+
+        encoder.state.info_raw.colortype = LCT_GREY;
+        encoder.state.info_raw.bitdepth = 1;
+        encoder.state.info_png.color.colortype = LCT_GREY;
+        encoder.state.info_png.color.bitdepth = 1;
+        encoder.state.encoder.auto_convert = 0;
+
+        unsigned error = encoder.encode(png, image, WIDTH, HEIGHT);
+        if (!error) error = lodepng::save_file(png, "mandelbrot.png");
+        if (error) printf("encoder error %d: %s", error, lodepng_error_text(error));
+    }
+
+    /*
+    Saves the boundary pixels listed by shader_mask.comp to mandelbrot_boundary.txt, a line
+    with "x y" for each of them. The shader appends them in whatever order its invocations
+    happen to run, so they are sorted by row and column first, to always give the same file.
+    */
+    void saveBoundary() {
+        void* mappedMemory = NULL;
+        VK_CHECK_RESULT(vkMapMemory(device, bufferMemory, 0, bufferSize, 0, &mappedMemory));
+        const uint32_t* words = (const uint32_t*)mappedMemory;
+        uint32_t count = words[MASK_WORDS];
+        uint32_t stored = std::min(count, (uint32_t)MAX_BOUNDARY_POINTS);
+        const uint32_t* coordinates = words + MASK_WORDS + 2;
+
+        std::vector<std::pair<uint32_t, uint32_t> > points(stored); // (y, x), so that they sort by row.
+        for (uint32_t i = 0; i < stored; ++i) {
+            points[i] = std::make_pair(coordinates[2 * i + 1], coordinates[2 * i]);
+        }
+        metricsAdd(METRIC_READBACK_BYTES, sizeof(uint32_t) * (2 + 2 * (uint64_t)stored));
+        vkUnmapMemory(device, bufferMemory);
+        std::sort(points.begin(), points.end());
+
+        if (count > stored) {
+            printf("only the first %u of %u boundary pixels fit in the buffer\n", stored, count);
+        }
+        FILE* file = fopen("mandelbrot_boundary.txt", "w");
+        if (!file) {
+            printf("could not open mandelbrot_boundary.txt\n");
+            return;
+        }
+        for (size_t i = 0; i < points.size(); ++i) {
+            fprintf(file, "%u %u\n", points[i].second, points[i].first);
+        }
+        fclose(file);
+    }
+
+    void saveRenderedImage() {
+        if (outputFormat == OUTPUT_PALETTE8) {
+            void* mappedMemory = NULL;
+            // Map the buffer memory, so that we can read from it on the CPU.
+            vkMapMemory(device, bufferMemory, 0, bufferSize, 0, &mappedMemory);
+
+            /*
+            The buffer already holds one palette index per pixel, which is exactly
+            the raw image data of a PNG with an 8-bit palette. So there is no conversion to do,
+            and by disabling auto_convert, lodepng does not analyze the colors of the image either.
+            */
+            makePalette(&encoder.state.info_raw);
+            makePalette(&encoder.state.info_png.color);
+            encoder.state.encoder.auto_convert = 0;
+
+            unsigned error = encoder.encode(png, (const unsigned char*)mappedMemory, WIDTH, HEIGHT);
+            metricsAdd(METRIC_READBACK_BYTES, bufferSize);
+            vkUnmapMemory(device, bufferMemory);
+
+            if (!error) error = lodepng::save_file(png, "mandelbrot.png");
+            if (error) printf("encoder error %d: %s", error, lodepng_error_text(error));
+            return;
+        }
+
+        if (outputFormat == OUTPUT_MASK1) {
+            saveMask();
+            if (collectBoundary) {
+                saveBoundary();
+            }
+            return;
+        }
+
+        if (benchmarkSave) {
+            benchmarkSaveFormats();
+            return;
+        }
 
-        // Now we save the acquired color data to a .png.
-        unsigned error = lodepng::encode("mandelbrot.png", image, WIDTH, HEIGHT);
+        // Read the rendered image back, and save it to a file.
+        convertImage(saveFormat);
+        unsigned error = writeImage(saveFormat);
         if (error) printf("encoder error %d: %s", error, lodepng_error_text(error));
     }
 
+    /*
+    Compares the rendered image with the CPU reference, given as the iterations of every pixel by
+    renderReferenceIterations: the colors of the float output, the palette indices, which are the iterations,
+    or the bits of the mask, which are set for the pixels that never escaped. Prints the largest and mean
+    error and how many pixels are off by more than the tolerance, and saves those pixels in white to
+    mandelbrot_mismatch.png. If more than REFERENCE_MAX_MISMATCH_FRACTION of them are, verificationFailed is set.
+    */
+    void verifyRenderedImage(const std::vector<unsigned char>& reference, const char* name) {
+        Conversion conversion = outputFormat == OUTPUT_MASK1 ? CONVERT_GREY1 : CONVERT_NONE;
+        image.resize(HEIGHT * rowBytes(conversion));
+        readBack(conversion, false, image.data());
+        const unsigned char* pixels = image.data();
+        const unsigned char* iterations = reference.data();
+
+        std::vector<unsigned char> mismatchMap(WIDTH * HEIGHT);
+        ReferenceDiff diff;
+        if (outputFormat == OUTPUT_PALETTE8) {
+            diff = diffAgainstReference(WIDTH, HEIGHT, 1, 0.0,
+                [=](unsigned x, unsigned y, int) { return double(pixels[WIDTH * y + x]); },
+                [=](unsigned x, unsigned y, int) { return double(iterations[WIDTH * y + x]); }, mismatchMap.data());
+        } else if (outputFormat == OUTPUT_MASK1) {
+            // The rows were read back as a 1-bit png stores them, the first pixel in the highest bit.
+            diff = diffAgainstReference(WIDTH, HEIGHT, 1, 0.0,
+                [=](unsigned x, unsigned y, int) { return double((pixels[WIDTH / 8 * y + x / 8] >> (7 - x % 8)) & 1); },
+                [=](unsigned x, unsigned y, int) { return iterations[WIDTH * y + x] == MAX_ITERATIONS ? 1.0 : 0.0; },
+                mismatchMap.data());
+        } else {
+            float colors[MAX_ITERATIONS + 1][3];
+            for (int n = 0; n <= MAX_ITERATIONS; ++n) {
+                referenceColor(n, colors[n]);
+            }
+            const Pixel* rendered = (const Pixel*)pixels;
+            diff = diffAgainstReference(WIDTH, HEIGHT, 3, REFERENCE_TOLERANCE,
+                [=](unsigned x, unsigned y, int c) { return double((&rendered[WIDTH * y + x].r)[c]); },
+                [&](unsigned x, unsigned y, int c) { return double(colors[iterations[WIDTH * y + x]][c]); },
+                mismatchMap.data());
+        }
+
+        bool passed = diff.mismatchFraction() <= REFERENCE_MAX_MISMATCH_FRACTION;
+        printf("  verify %-18s max error %.6f, mean error %.6f, %zu of %zu pixels differ (%.4f%%): %s\n", name,
+            diff.maxError, diff.meanError, diff.mismatches, diff.pixels, 100.0 * diff.mismatchFraction(),
+            passed ? "ok" : "FAILED");
+        if (diff.mismatches > 0) {
+            unsigned error = lodepng::encode("mandelbrot_mismatch.png", mismatchMap, WIDTH, HEIGHT, LCT_GREY, 8);
+            if (error) printf("encoder error %d: %s", error, lodepng_error_text(error));
+        }
+        if (!passed) {
+            verificationFailed = true;
+        }
+    }
+
     static VKAPI_ATTR VkBool32 VKAPI_CALL debugReportCallbackFn(
         VkDebugReportFlagsEXT                       flags,
         VkDebugReportObjectTypeEXT                  objectType,
@@ -264,7 +1048,8 @@ public:
         applicationInfo.applicationVersion = 0;
         applicationInfo.pEngineName = "awesomeengine";
         applicationInfo.engineVersion = 0;
-        applicationInfo.apiVersion = VK_API_VERSION_1_0;;
+        // The subgroup operations of shader_mask.comp, shader_persistent.comp and comp_stats.spv are core in Vulkan 1.1.
+        applicationInfo.apiVersion = outputFormat == OUTPUT_MASK1 || usesViewKernel() || collectStatistics ? VK_API_VERSION_1_1 : VK_API_VERSION_1_0;
         
         VkInstanceCreateInfo createInfo = {};
         createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
@@ -355,6 +1140,65 @@ public:
         }
     }
 
+    /*
+    shader_mask.comp lists the boundary pixels with subgroupBallot, shader_persistent.comp
+    hands out pixels with ballots and votes, and comp_stats.spv adds up its statistics with subgroupAdd.
+    They need a device with Vulkan 1.1 that supports the `needed` operations in compute shaders, and
+    subgroups that fit in a ballot. Throws if the physical device can't run the shader.
+    */
+    void checkSubgroupSupport(VkSubgroupFeatureFlags needed) {
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+        if (properties.apiVersion < VK_API_VERSION_1_1) {
+            throw std::runtime_error("subgroup operations need a device with Vulkan 1.1");
+        }
+
+        VkPhysicalDeviceSubgroupProperties subgroupProperties = {};
+        subgroupProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES;
+        VkPhysicalDeviceProperties2 properties2 = {};
+        properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+        properties2.pNext = &subgroupProperties;
+        vkGetPhysicalDeviceProperties2(physicalDevice, &properties2);
+
+        if (!(subgroupProperties.supportedStages & VK_SHADER_STAGE_COMPUTE_BIT) ||
+            (subgroupProperties.supportedOperations & needed) != needed) {
+            throw std::runtime_error("the device lacks the subgroup operations the compute shader uses");
+        }
+        if (subgroupProperties.subgroupSize > (uint32_t)MAX_SUBGROUP_SIZE) {
+            throw std::runtime_error("the compute shader can't use subgroups of the size the device has");
+        }
+    }
+
+    /*
+    Whether the physical device has VK_KHR_shader_clock with the subgroup clock, which comp_persistent_clock.spv
+    reads to time its workgroups. Without it, printLoadBalance falls back to the iteration counts.
+    */
+    bool supportsShaderClock() {
+        uint32_t extensionCount = 0;
+        vkEnumerateDeviceExtensionProperties(physicalDevice, NULL, &extensionCount, NULL);
+        std::vector<VkExtensionProperties> extensionProperties(extensionCount);
+        vkEnumerateDeviceExtensionProperties(physicalDevice, NULL, &extensionCount, extensionProperties.data());
+
+        bool foundExtension = false;
+        for (VkExtensionProperties prop : extensionProperties) {
+            if (strcmp(VK_KHR_SHADER_CLOCK_EXTENSION_NAME, prop.extensionName) == 0) {
+                foundExtension = true;
+                break;
+            }
+        }
+        if (!foundExtension) {
+            return false;
+        }
+
+        VkPhysicalDeviceShaderClockFeaturesKHR clockFeatures = {};
+        clockFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_CLOCK_FEATURES_KHR;
+        VkPhysicalDeviceFeatures2 features2 = {};
+        features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        features2.pNext = &clockFeatures;
+        vkGetPhysicalDeviceFeatures2(physicalDevice, &features2);
+        return clockFeatures.shaderSubgroupClock == VK_TRUE;
+    }
+
     // Returns the index of a queue family that supports compute operations. 
     uint32_t getComputeQueueFamilyIndex() {
         uint32_t queueFamilyCount;
@@ -415,6 +1259,17 @@ public:
         deviceCreateInfo.queueCreateInfoCount = 1;
         deviceCreateInfo.pEnabledFeatures = &deviceFeatures;
 
+        // comp_persistent_clock.spv reads the subgroup clock, which has to be enabled with its extension.
+        const char* clockExtension = VK_KHR_SHADER_CLOCK_EXTENSION_NAME;
+        VkPhysicalDeviceShaderClockFeaturesKHR clockFeatures = {};
+        clockFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_CLOCK_FEATURES_KHR;
+        clockFeatures.shaderSubgroupClock = VK_TRUE;
+        if (shaderClock) {
+            deviceCreateInfo.enabledExtensionCount = 1;
+            deviceCreateInfo.ppEnabledExtensionNames = &clockExtension;
+            deviceCreateInfo.pNext = &clockFeatures;
+        }
+
         VK_CHECK_RESULT(vkCreateDevice(physicalDevice, &deviceCreateInfo, NULL, &device)); // create logical device.
 
         // Get a handle to the only member of the queue family.
@@ -486,6 +1341,50 @@ public:
         
         // Now associate that allocated memory with the buffer. With that, the buffer is backed by actual memory. 
         VK_CHECK_RESULT(vkBindBufferMemory(device, buffer, bufferMemory, 0));
+
+        if (outputFormat == OUTPUT_MASK1) {
+            // shader_mask.comp appends the boundary pixels to the list behind the mask, which has to start out empty.
+            void* mappedMemory = NULL;
+            VK_CHECK_RESULT(vkMapMemory(device, bufferMemory, 0, bufferSize, 0, &mappedMemory));
+            ((uint32_t*)mappedMemory)[MASK_WORDS] = 0;
+            vkUnmapMemory(device, bufferMemory);
+        }
+    }
+
+    // Creates a storage buffer of `size` bytes with its own memory, like createBuffer does for `buffer`.
+    void createStorageBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties,
+                             VkBuffer& newBuffer, VkDeviceMemory& newMemory) {
+        VkBufferCreateInfo bufferCreateInfo = {};
+        bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        bufferCreateInfo.size = size;
+        bufferCreateInfo.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | usage;
+        bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        VK_CHECK_RESULT(vkCreateBuffer(device, &bufferCreateInfo, NULL, &newBuffer));
+
+        VkMemoryRequirements memoryRequirements;
+        vkGetBufferMemoryRequirements(device, newBuffer, &memoryRequirements);
+
+        VkMemoryAllocateInfo allocateInfo = {};
+        allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        allocateInfo.allocationSize = memoryRequirements.size;
+        allocateInfo.memoryTypeIndex = findMemoryType(memoryRequirements.memoryTypeBits, properties);
+        VK_CHECK_RESULT(vkAllocateMemory(device, &allocateInfo, NULL, &newMemory));
+        VK_CHECK_RESULT(vkBindBufferMemory(device, newBuffer, newMemory, 0));
+    }
+
+    void createWorkBuffers() {
+        /*
+        The queue counters of shader_persistent.comp. Every subgroup or workgroup does atomics on them, and
+        only the GPU touches them, so unlike `buffer` they live in device local memory.
+        The command buffer zeroes them with vkCmdFillBuffer, so they are a transfer destination too.
+        */
+        createStorageBuffer(2 * sizeof(uint32_t), VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            workBuffer, workBufferMemory);
+
+        // Every workgroup writes its stats once, at its end, and the host reads them, so they are host visible.
+        statsCount = std::max(workgroupsOf(SCHEDULE_2D), residentWorkgroups);
+        createStorageBuffer(sizeof(WorkgroupStats) * statsCount, 0,
+            VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, statsBuffer, statsBufferMemory);
     }
 
     void createDescriptorSetLayout() {
@@ -503,16 +1402,25 @@ public:
 
         in the compute shader.
         */
-        VkDescriptorSetLayoutBinding descriptorSetLayoutBinding = {};
-        descriptorSetLayoutBinding.binding = 0; // binding = 0
-        descriptorSetLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-        descriptorSetLayoutBinding.descriptorCount = 1;
-        descriptorSetLayoutBinding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        VkDescriptorSetLayoutBinding descriptorSetLayoutBindings[3] = {};
+        descriptorSetLayoutBindings[0].binding = 0; // binding = 0
+        descriptorSetLayoutBindings[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        descriptorSetLayoutBindings[0].descriptorCount = 1;
+        descriptorSetLayoutBindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+        /*
+        shader_persistent.comp also binds its queue counters, `workBuffer`, to binding point 1, and `statsBuffer` to 2,
+        and shader.comp its statistics, `statisticsBuffer`, to 1.
+        */
+        for (uint32_t binding = 1; binding < 3; ++binding) {
+            descriptorSetLayoutBindings[binding] = descriptorSetLayoutBindings[0];
+            descriptorSetLayoutBindings[binding].binding = binding;
+        }
 
         VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo = {};
         descriptorSetLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-        descriptorSetLayoutCreateInfo.bindingCount = 1; // only a single binding in this descriptor set layout. 
-        descriptorSetLayoutCreateInfo.pBindings = &descriptorSetLayoutBinding; 
+        descriptorSetLayoutCreateInfo.bindingCount = bindingCount();
+        descriptorSetLayoutCreateInfo.pBindings = descriptorSetLayoutBindings; 
 
         // Create the descriptor set layout. 
         VK_CHECK_RESULT(vkCreateDescriptorSetLayout(device, &descriptorSetLayoutCreateInfo, NULL, &descriptorSetLayout));
@@ -525,11 +1433,12 @@ public:
         */
 
         /*
-        Our descriptor pool can only allocate a single storage buffer.
+        Our descriptor pool can only allocate the storage buffers of a single set: one,
+        three for shader_persistent.comp, or two for shader.comp with its statistics.
         */
         VkDescriptorPoolSize descriptorPoolSize = {};
         descriptorPoolSize.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-        descriptorPoolSize.descriptorCount = 1;
+        descriptorPoolSize.descriptorCount = bindingCount();
 
         VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = {};
         descriptorPoolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
@@ -563,16 +1472,42 @@ public:
         descriptorBufferInfo.offset = 0;
         descriptorBufferInfo.range = bufferSize;
 
-        VkWriteDescriptorSet writeDescriptorSet = {};
-        writeDescriptorSet.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        writeDescriptorSet.dstSet = descriptorSet; // write to this descriptor set.
-        writeDescriptorSet.dstBinding = 0; // write to the first, and only binding.
-        writeDescriptorSet.descriptorCount = 1; // update a single descriptor.
-        writeDescriptorSet.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER; // storage buffer.
-        writeDescriptorSet.pBufferInfo = &descriptorBufferInfo;
+        VkWriteDescriptorSet writeDescriptorSets[3] = {};
+        writeDescriptorSets[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writeDescriptorSets[0].dstSet = descriptorSet; // write to this descriptor set.
+        writeDescriptorSets[0].dstBinding = 0; // write to the first binding.
+        writeDescriptorSets[0].descriptorCount = 1; // update a single descriptor.
+        writeDescriptorSets[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER; // storage buffer.
+        writeDescriptorSets[0].pBufferInfo = &descriptorBufferInfo;
+
+        VkDescriptorBufferInfo workBufferInfo = {};
+        workBufferInfo.buffer = workBuffer;
+        workBufferInfo.offset = 0;
+        workBufferInfo.range = 2 * sizeof(uint32_t);
+
+        writeDescriptorSets[1] = writeDescriptorSets[0];
+        writeDescriptorSets[1].dstBinding = 1; // the queue counters of shader_persistent.comp.
+        writeDescriptorSets[1].pBufferInfo = &workBufferInfo;
+
+        VkDescriptorBufferInfo statsBufferInfo = {};
+        statsBufferInfo.buffer = statsBuffer;
+        statsBufferInfo.offset = 0;
+        statsBufferInfo.range = sizeof(WorkgroupStats) * statsCount;
+
+        writeDescriptorSets[2] = writeDescriptorSets[0];
+        writeDescriptorSets[2].dstBinding = 2; // the stats of the workgroups.
+        writeDescriptorSets[2].pBufferInfo = &statsBufferInfo;
+
+        VkDescriptorBufferInfo statisticsBufferInfo = {};
+        statisticsBufferInfo.buffer = statisticsBuffer;
+        statisticsBufferInfo.offset = 0;
+        statisticsBufferInfo.range = sizeof(KernelStatistics);
+        if (collectStatistics) {
+            writeDescriptorSets[1].pBufferInfo = &statisticsBufferInfo; // the statistics of shader.comp.
+        }
 
         // perform the update of the descriptor set.
-        vkUpdateDescriptorSets(device, 1, &writeDescriptorSet, 0, NULL);
+        vkUpdateDescriptorSets(device, bindingCount(), writeDescriptorSets, 0, NULL);
     }
 
     // Read file into array of bytes, and cast to uint32_t*, then return.
@@ -581,7 +1516,8 @@ public:
 
         FILE* fp = fopen(filename, "rb");
         if (fp == NULL) {
-            printf("Could not find or open file: %s\n", filename);
+            // The shaders in the shaders directory have to be compiled with glslangValidator first, see README.md.
+            throw std::runtime_error(std::string("could not find or open file: ") + filename);
         }
 
         // get file size.
@@ -605,6 +1541,26 @@ public:
         return (uint32_t *)str;
     }
 
+    /*
+    Whether the SPIR-V module of `length` bytes declares the specialization constant `specId`, so setting it
+    has an effect. A shader compiled from an older source ignores the constant without any error.
+    */
+    static bool declaresSpecConstant(const uint32_t* code, uint32_t length, uint32_t specId) {
+        const uint32_t OP_DECORATE = 71, DECORATION_SPEC_ID = 1;
+        uint32_t words = length / 4;
+        // The header is 5 words, then every instruction starts with its word count and opcode.
+        for (uint32_t i = 5; i < words; ) {
+            uint32_t wordCount = code[i] >> 16, opcode = code[i] & 0xFFFF;
+            if (wordCount == 0) break;
+            if (opcode == OP_DECORATE && wordCount == 4 && i + 3 < words &&
+                code[i + 2] == DECORATION_SPEC_ID && code[i + 3] == specId) {
+                return true;
+            }
+            i += wordCount;
+        }
+        return false;
+    }
+
     void createComputePipeline() {
         /*
         We create a compute pipeline here. 
@@ -614,16 +1570,71 @@ public:
         Create a shader module. A shader module basically just encapsulates some shader code.
         */
         uint32_t filelength;
+#ifdef EMBEDDED_SHADERS
+        // The build compiled the shaders into the executable, so nothing has to be read.
+        const uint32_t* code = comp_spv;
+        filelength = sizeof(comp_spv);
+        if (outputFormat == OUTPUT_PALETTE8) {
+            code = comp_palette_spv;
+            filelength = sizeof(comp_palette_spv);
+        } else if (outputFormat == OUTPUT_MASK1) {
+            code = comp_mask_spv;
+            filelength = sizeof(comp_mask_spv);
+        } else if (usesViewKernel() && shaderClock) {
+            code = comp_persistent_clock_spv;
+            filelength = sizeof(comp_persistent_clock_spv);
+        } else if (usesViewKernel()) {
+            code = comp_persistent_spv;
+            filelength = sizeof(comp_persistent_spv);
+        } else if (collectStatistics) {
+            code = comp_stats_spv;
+            filelength = sizeof(comp_stats_spv);
+        }
+#else
+        // Without glslangValidator at build time, the shaders are read from the shaders directory.
         // the code in comp.spv was created by running the command:
         // glslangValidator.exe -V shader.comp
-        uint32_t* code = readFile(filelength, "shaders/comp.spv");
+        // comp_palette.spv by:
+        // glslangValidator.exe -V shader_palette.comp -o comp_palette.spv
+        // comp_mask.spv by:
+        // glslangValidator.exe -V --target-env vulkan1.1 shader_mask.comp -o comp_mask.spv
+        // comp_persistent.spv by:
+        // glslangValidator.exe -V --target-env vulkan1.1 shader_persistent.comp -o comp_persistent.spv
+        // comp_persistent_clock.spv by:
+        // glslangValidator.exe -V --target-env vulkan1.1 -DSHADER_CLOCK shader_persistent.comp -o comp_persistent_clock.spv
+        // and comp_stats.spv by:
+        // glslangValidator.exe -V --target-env vulkan1.1 -DSTATISTICS shader.comp -o comp_stats.spv
+        const char* shaderFile = "shaders/comp.spv";
+        if (outputFormat == OUTPUT_PALETTE8) {
+            shaderFile = "shaders/comp_palette.spv";
+        } else if (outputFormat == OUTPUT_MASK1) {
+            shaderFile = "shaders/comp_mask.spv";
+        } else if (usesViewKernel() && shaderClock) {
+            shaderFile = "shaders/comp_persistent_clock.spv";
+        } else if (usesViewKernel()) {
+            shaderFile = "shaders/comp_persistent.spv";
+        } else if (collectStatistics) {
+            shaderFile = "shaders/comp_stats.spv";
+        }
+        uint32_t* code = readFile(filelength, shaderFile);
+#endif
+        // With a shader that lacks TILED_LAYOUT, the rows would be put back together from tiles that were never written.
+        if (tiledLayout && !declaresSpecConstant(code, filelength, 0)) {
+#ifndef EMBEDDED_SHADERS
+            delete[] code;
+#endif
+            throw std::runtime_error("--tiled needs a shader compiled from the current sources, with the TILED_LAYOUT constant, see README.md");
+        }
+
         VkShaderModuleCreateInfo createInfo = {};
         createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
         createInfo.pCode = code;
         createInfo.codeSize = filelength;
         
         VK_CHECK_RESULT(vkCreateShaderModule(device, &createInfo, NULL, &computeShaderModule));
+#ifndef EMBEDDED_SHADERS
         delete[] code;
+#endif
 
         /*
         Now let us actually create the compute pipeline.
@@ -638,6 +1649,21 @@ public:
         shaderStageCreateInfo.module = computeShaderModule;
         shaderStageCreateInfo.pName = "main";
 
+        // shader.comp and shader_persistent.comp store the image as tiles if their constant 0, TILED_LAYOUT, is true.
+        VkBool32 tiled = tiledLayout ? VK_TRUE : VK_FALSE;
+        VkSpecializationMapEntry specializationMapEntry = {};
+        specializationMapEntry.constantID = 0;
+        specializationMapEntry.offset = 0;
+        specializationMapEntry.size = sizeof(tiled);
+        VkSpecializationInfo specializationInfo = {};
+        specializationInfo.mapEntryCount = 1;
+        specializationInfo.pMapEntries = &specializationMapEntry;
+        specializationInfo.dataSize = sizeof(tiled);
+        specializationInfo.pData = &tiled;
+        if (outputFormat == OUTPUT_RGBA32F) {
+            shaderStageCreateInfo.pSpecializationInfo = &specializationInfo;
+        }
+
         /*
         The pipeline layout allows the pipeline to access descriptor sets. 
         So we just specify the descriptor set layout we created earlier.
@@ -646,6 +1672,19 @@ public:
         pipelineLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
         pipelineLayoutCreateInfo.setLayoutCount = 1;
         pipelineLayoutCreateInfo.pSetLayouts = &descriptorSetLayout; 
+
+        /*
+        shader_mask.comp is told which of its two passes to run with a push constant,
+        and shader_persistent.comp the view and the schedule.
+        */
+        VkPushConstantRange pushConstantRange = {};
+        pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        pushConstantRange.offset = 0;
+        pushConstantRange.size = usesViewKernel() ? sizeof(ViewPushConstants) : sizeof(uint32_t);
+        if (outputFormat == OUTPUT_MASK1 || usesViewKernel()) {
+            pipelineLayoutCreateInfo.pushConstantRangeCount = 1;
+            pipelineLayoutCreateInfo.pPushConstantRanges = &pushConstantRange;
+        }
         VK_CHECK_RESULT(vkCreatePipelineLayout(device, &pipelineLayoutCreateInfo, NULL, &pipelineLayout));
 
         VkComputePipelineCreateInfo pipelineCreateInfo = {};
@@ -670,7 +1709,8 @@ public:
         */
         VkCommandPoolCreateInfo commandPoolCreateInfo = {};
         commandPoolCreateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-        commandPoolCreateInfo.flags = 0;
+        // benchmarkSchedules records the command buffer again for every view and schedule.
+        commandPoolCreateInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
         // the queue family of this command pool. All command buffers allocated from this command pool,
         // must be submitted to queues of this family ONLY. 
         commandPoolCreateInfo.queueFamilyIndex = queueFamilyIndex;
@@ -689,14 +1729,43 @@ public:
         commandBufferAllocateInfo.commandBufferCount = 1; // allocate a single command buffer. 
         VK_CHECK_RESULT(vkAllocateCommandBuffers(device, &commandBufferAllocateInfo, &commandBuffer)); // allocate command buffer.
 
+        recordCommandBuffer(DEFAULT_VIEW, schedule);
+    }
+
+    /*
+    Records the commands that render the image into `commandBuffer`, replacing any recorded before.
+    shader_persistent.comp renders `view` with `schedule`, the other shaders ignore them.
+    */
+    void recordCommandBuffer(const View& view, Schedule schedule) {
         /*
         Now we shall start recording commands into the newly allocated command buffer. 
         */
+        VK_CHECK_RESULT(vkResetCommandBuffer(commandBuffer, 0));
         VkCommandBufferBeginInfo beginInfo = {};
         beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT; // the buffer is only submitted and used once in this application.
+        // the buffer is submitted once, except while benchmarking, which runs it a few times before recording it again.
+        beginInfo.flags = benchmarkKernels ? 0 : VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
         VK_CHECK_RESULT(vkBeginCommandBuffer(commandBuffer, &beginInfo)); // start recording commands.
 
+        if (usesViewKernel() || collectStatistics) {
+            // Empty the queues of shader_persistent.comp or the statistics of shader.comp, and let the dispatch wait until they are.
+            if (usesViewKernel()) {
+                vkCmdFillBuffer(commandBuffer, workBuffer, 0, 2 * sizeof(uint32_t), 0);
+            } else {
+                vkCmdFillBuffer(commandBuffer, statisticsBuffer, 0, sizeof(KernelStatistics), 0);
+            }
+            VkMemoryBarrier barrier = {};
+            barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+            vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                0, 1, &barrier, 0, NULL, 0, NULL);
+        }
+        if (queryPool != VK_NULL_HANDLE) {
+            vkCmdResetQueryPool(commandBuffer, queryPool, 0, 2);
+            vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, queryPool, 0);
+        }
+
         /*
         We need to bind a pipeline, AND a descriptor set before we dispatch.
 
@@ -710,11 +1779,72 @@ public:
         The number of workgroups is specified in the arguments.
         If you are already familiar with compute shaders from OpenGL, this should be nothing new to you.
         */
-        vkCmdDispatch(commandBuffer, (uint32_t)ceil(WIDTH / float(WORKGROUP_SIZE)), (uint32_t)ceil(HEIGHT / float(WORKGROUP_SIZE)), 1);
+        uint32_t invocationsX = WIDTH;
+        if (outputFormat == OUTPUT_PALETTE8) {
+            invocationsX = WIDTH / PALETTE_PIXELS_PER_INVOCATION; // every invocation renders several pixels.
+        }
+        uint32_t groupsX = (uint32_t)ceil(invocationsX / float(WORKGROUP_SIZE));
+        uint32_t groupsY = (uint32_t)ceil(HEIGHT / float(WORKGROUP_SIZE));
+        if (outputFormat == OUTPUT_MASK1) {
+            uint32_t passIndex = 0; // render the mask.
+            vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(passIndex), &passIndex);
+        }
+        if (usesViewKernel()) {
+            ViewPushConstants constants;
+            constants.center[0] = view.centerX;
+            constants.center[1] = view.centerY;
+            constants.scale = view.scale;
+            constants.schedule = schedule;
+            vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+            if (schedule != SCHEDULE_2D) {
+                groupsX = workgroupsOf(schedule);
+                groupsY = 1;
+            }
+        }
+        vkCmdDispatch(commandBuffer, groupsX, groupsY, 1);
+
+        if (collectBoundary) {
+            /*
+            Finding the boundary pixels needs the mask bits of their neighbours, some of which
+            other workgroups write. So the second pass is a dispatch of its own, which may only start
+            reading once the whole mask has been written.
+            */
+            VkMemoryBarrier barrier = {};
+            barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+            barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+            vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                0, 1, &barrier, 0, NULL, 0, NULL);
+
+            uint32_t passIndex = 1; // list the boundary pixels.
+            vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(passIndex), &passIndex);
+            vkCmdDispatch(commandBuffer, groupsX, groupsY, 1);
+        }
+        if (queryPool != VK_NULL_HANDLE) {
+            vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPool, 1);
+        }
 
         VK_CHECK_RESULT(vkEndCommandBuffer(commandBuffer)); // end recording commands.
     }
 
+    void createQueryPool() {
+        uint32_t queueFamilyCount;
+        vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, NULL);
+        std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+        vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies.data());
+        timestampValidBits = queueFamilies[queueFamilyIndex].timestampValidBits;
+        if (timestampValidBits == 0) {
+            throw std::runtime_error("the compute queue can't write timestamps, so the kernels can't be timed");
+        }
+
+        // Two timestamps, before and after the dispatch.
+        VkQueryPoolCreateInfo queryPoolCreateInfo = {};
+        queryPoolCreateInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        queryPoolCreateInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        queryPoolCreateInfo.queryCount = 2;
+        VK_CHECK_RESULT(vkCreateQueryPool(device, &queryPoolCreateInfo, NULL, &queryPool));
+    }
+
     void runCommandBuffer() {
         /*
         Now we shall finally submit the recorded command buffer to a queue.
@@ -738,6 +1868,7 @@ public:
         We submit the command buffer on the queue, at the same time giving a fence.
         */
         VK_CHECK_RESULT(vkQueueSubmit(queue, 1, &submitInfo, fence));
+        metricsAdd(METRIC_VULKAN_SUBMITS, 1);
         /*
         The command will not have finished executing until the fence is signalled.
         So we wait here.
@@ -745,7 +1876,10 @@ public:
         and we will not be sure that the command has finished executing unless we wait for the fence.
         Hence, we use a fence here.
         */
+        auto waitStart = std::chrono::steady_clock::now();
         VK_CHECK_RESULT(vkWaitForFences(device, 1, &fence, VK_TRUE, 100000000000));
+        metricsAdd(METRIC_FENCE_WAIT_NS,
+            std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - waitStart).count());
 
         vkDestroyFence(device, fence, NULL);
     }
@@ -766,6 +1900,19 @@ public:
 
         vkFreeMemory(device, bufferMemory, NULL);
         vkDestroyBuffer(device, buffer, NULL);	
+        if (usesViewKernel()) {
+            vkFreeMemory(device, workBufferMemory, NULL);
+            vkDestroyBuffer(device, workBuffer, NULL);
+            vkFreeMemory(device, statsBufferMemory, NULL);
+            vkDestroyBuffer(device, statsBuffer, NULL);
+        }
+        if (collectStatistics) {
+            vkFreeMemory(device, statisticsBufferMemory, NULL);
+            vkDestroyBuffer(device, statisticsBuffer, NULL);
+        }
+        if (queryPool != VK_NULL_HANDLE) {
+            vkDestroyQueryPool(device, queryPool, NULL);
+        }
         vkDestroyShaderModule(device, computeShaderModule, NULL);
         vkDestroyDescriptorPool(device, descriptorPool, NULL);
         vkDestroyDescriptorSetLayout(device, descriptorSetLayout, NULL);
@@ -777,10 +1924,67 @@ public:
     }
 };
 
-int main() {
-    ComputeApplication app;
+int main(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--palette") == 0) {
+            options.format = OUTPUT_PALETTE8; // let the GPU output palette indices instead of colors.
+        } else if (strcmp(argv[i], "--mask") == 0) {
+            options.format = OUTPUT_MASK1; // let the GPU output a bit per pixel, whether it is inside the set.
+        } else if (strcmp(argv[i], "--boundary") == 0) {
+            options.boundary = true; // also list the pixels on the boundary of the set.
+        } else if (strcmp(argv[i], "--png16") == 0) {
+            options.save = SAVE_PNG16; // keep 16 bits of the rendered floats.
+        } else if (strcmp(argv[i], "--pfm") == 0) {
+            options.save = SAVE_PFM; // keep the rendered floats as they are.
+        } else if (strcmp(argv[i], "--bench-save") == 0) {
+            options.benchmarkSave = true; // time saving in every format.
+        } else if (strcmp(argv[i], "--persistent") == 0) {
+            options.schedule = SCHEDULE_PERSISTENT; // render with persistent threads that take pixels from a queue.
+        } else if (strcmp(argv[i], "--tiles") == 0) {
+            options.schedule = SCHEDULE_TILES; // render with workgroups that take tiles from a queue.
+        } else if (strcmp(argv[i], "--workgroups") == 0 && i + 1 < argc) {
+            options.workgroups = atoi(argv[++i]); // the workgroups of --persistent and --tiles.
+        } else if (strcmp(argv[i], "--tiled") == 0) {
+            options.tiledLayout = true; // store the float output as tiles, and put the rows back together on readback.
+        } else if (strcmp(argv[i], "--bench-kernel") == 0) {
+            options.benchmarkKernels = true; // time the 2d dispatch against the persistent threads and the tiles.
+        } else if (strcmp(argv[i], "--verify") == 0) {
+            options.verify = true; // compare the rendered images with the CPU reference.
+        } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+            options.metricsFile = argv[++i]; // write the counters in the Prometheus text format to this file.
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            options.statistics = true; // let the GPU add up the iterations it does and the pixels inside the set.
+        } else {
+            printf("unknown argument: %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (options.format != OUTPUT_RGBA32F &&
+        (options.save != SAVE_PNG8 || options.benchmarkSave || options.schedule != SCHEDULE_2D || options.benchmarkKernels ||
+         options.tiledLayout || options.statistics)) {
+        printf("--png16, --pfm, --bench-save, --persistent, --tiles, --tiled, --bench-kernel and --stats need the float output, not --palette or --mask\n");
+        return EXIT_FAILURE;
+    }
+    if (options.statistics && (options.schedule != SCHEDULE_2D || options.benchmarkKernels)) {
+        printf("--stats is collected by shader.comp, so it can't be combined with --persistent, --tiles or --bench-kernel\n");
+        return EXIT_FAILURE;
+    }
+    if (options.workgroups < 1) {
+        printf("--workgroups needs a positive number\n");
+        return EXIT_FAILURE;
+    }
+    if (options.metricsFile && !METRICS_ENABLED) {
+        printf("--metrics needs a build with the METRICS option\n");
+        return EXIT_FAILURE;
+    }
+    if (options.boundary && options.format != OUTPUT_MASK1) {
+        printf("--boundary needs --mask\n");
+        return EXIT_FAILURE;
+    }
 
     try {
+        ComputeApplication app(options);
         app.run();
     }
     catch (const std::runtime_error& e) {
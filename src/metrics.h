@@ -0,0 +1,169 @@
+/*
+Counters of the work done on the hot paths: bytes read back from the GPU, deflated and inflated,
+the LZ77 search, the Vulkan submits and the time spent waiting for them, and the iterations the
+compute shader reports, so a running process can be looked into. Counting is lock-free: every thread
+adds to its own block of counters, which only it writes, and metricsSnapshot sums the blocks of all
+threads. The hot loops count into locals and add them once per call, so counting costs well under 1%
+of the time.
+Built without ENABLE_METRICS (the CMake option METRICS), metricsAdd does nothing and the snapshot is zero.
+*/
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+#ifdef ENABLE_METRICS
+#include <atomic>
+#endif
+
+enum Metric {
+    METRIC_READBACK_BYTES, // bytes of rendered images read from mapped GPU memory.
+    METRIC_DEFLATE_BYTES, // bytes of filtered image data deflated into IDAT and fdAT chunks, not the trials of LFS_BRUTE_FORCE.
+    METRIC_LZ77_MATCHES, // length/distance pairs encodeLZ77 found, also in the trials of LFS_BRUTE_FORCE.
+    METRIC_LZ77_CHAIN_STEPS, // hash chain entries encodeLZ77 compared while searching for them.
+    METRIC_INFLATE_SYMBOLS, // literal and length symbols inflate decoded.
+    METRIC_VULKAN_SUBMITS, // command buffers submitted to the queue.
+    METRIC_FENCE_WAIT_NS, // nanoseconds spent waiting for the fences of the submits.
+    // mandelbrot iterations shader.comp did, with --stats: the passes through its loop, min(n + 1, M) per
+    // pixel for the `n` of the shader, so the iteration a pixel escapes in counts too. The iterations of
+    // the WorkgroupStats of shader_persistent.comp are counted the same way.
+    METRIC_KERNEL_ITERATIONS,
+    METRIC_ESCAPED_PIXELS, // pixels shader.comp found to escape, with --stats.
+    METRIC_INTERIOR_PIXELS, // pixels shader.comp found to stay inside the set for all iterations, with --stats.
+    METRIC_COUNT
+};
+
+// The names, and what they count, of the metrics in the Prometheus text format.
+const char* const METRIC_NAMES[METRIC_COUNT] = {
+    "readback_bytes_total", "deflate_bytes_total", "lz77_matches_total", "lz77_chain_steps_total",
+    "inflate_symbols_total", "vulkan_submits_total", "fence_wait_seconds_total",
+    "kernel_iterations_total", "escaped_pixels_total", "interior_pixels_total",
+};
+const char* const METRIC_HELP[METRIC_COUNT] = {
+    "Bytes of rendered images read back from the GPU.",
+    "Bytes of filtered image data deflated into the png.",
+    "Length/distance pairs found by LZ77.",
+    "Hash chain entries compared by the LZ77 search.",
+    "Literal and length symbols decoded by inflate.",
+    "Command buffers submitted to the Vulkan queue.",
+    "Seconds spent waiting for the fences of the submits.",
+    "Mandelbrot iterations done by the compute shader.",
+    "Pixels the compute shader found to escape.",
+    "Pixels the compute shader found inside the set, which took every iteration.",
+};
+
+// The sums of the counters of all threads at one moment.
+struct MetricsSnapshot {
+    uint64_t values[METRIC_COUNT];
+};
+
+#ifdef ENABLE_METRICS
+const bool METRICS_ENABLED = true;
+
+/*
+The counters of a thread. A block is only written by the thread that owns it, with plain loads and stores
+instead of read-modify-writes, and read by the snapshots. When the thread exits the block keeps its
+counts, and the next thread to start takes it over, so there are never more blocks than threads at once.
+*/
+struct MetricsBlock {
+    std::atomic<uint64_t> values[METRIC_COUNT];
+    std::atomic<bool> owned;
+    MetricsBlock* next; // set before the block is published, and never changed after.
+};
+
+// The list of all blocks. Blocks are pushed to the front and never removed.
+inline std::atomic<MetricsBlock*>& metricsBlocks() {
+    static std::atomic<MetricsBlock*> blocks(nullptr);
+    return blocks;
+}
+
+// Takes over a block no thread owns, or adds a new one.
+inline MetricsBlock* claimMetricsBlock() {
+    for (MetricsBlock* block = metricsBlocks().load(std::memory_order_acquire); block; block = block->next) {
+        bool owned = false;
+        if (!block->owned.load(std::memory_order_relaxed) &&
+            block->owned.compare_exchange_strong(owned, true, std::memory_order_acquire)) {
+            return block;
+        }
+    }
+    MetricsBlock* block = new MetricsBlock();
+    for (int i = 0; i < METRIC_COUNT; ++i) {
+        block->values[i].store(0, std::memory_order_relaxed);
+    }
+    block->owned.store(true, std::memory_order_relaxed);
+    block->next = metricsBlocks().load(std::memory_order_relaxed);
+    while (!metricsBlocks().compare_exchange_weak(block->next, block, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+    return block;
+}
+
+// Owns the block of a thread, and gives it up when the thread exits.
+struct MetricsThread {
+    MetricsBlock* block;
+    MetricsThread() : block(claimMetricsBlock()) {}
+    ~MetricsThread() { block->owned.store(false, std::memory_order_release); }
+};
+
+inline void metricsAdd(Metric metric, uint64_t n) {
+    static thread_local MetricsThread thread;
+    std::atomic<uint64_t>& value = thread.block->values[metric];
+    value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+/*
+Sums the counters of all threads. Every counter is read atomically, but threads go on counting while
+they are read, so one counter may include work another doesn't yet.
+*/
+inline MetricsSnapshot metricsSnapshot() {
+    MetricsSnapshot snapshot = {};
+    for (MetricsBlock* block = metricsBlocks().load(std::memory_order_acquire); block; block = block->next) {
+        for (int i = 0; i < METRIC_COUNT; ++i) {
+            snapshot.values[i] += block->values[i].load(std::memory_order_relaxed);
+        }
+    }
+    return snapshot;
+}
+#else /*ENABLE_METRICS*/
+const bool METRICS_ENABLED = false;
+
+inline void metricsAdd(Metric, uint64_t) {}
+
+inline MetricsSnapshot metricsSnapshot() {
+    MetricsSnapshot snapshot = {};
+    return snapshot;
+}
+#endif /*ENABLE_METRICS*/
+
+/*
+Writes a snapshot to filename in the Prometheus text format, every metric prefixed with `prefix`,
+for the textfile collector of the node exporter or anything else that scrapes such files.
+The snapshot is written to filename.tmp first and then renamed to filename, so a scraper never
+reads a half written file. Returns whether the file was written.
+*/
+inline bool writeMetricsPrometheus(const char* filename, const char* prefix) {
+    MetricsSnapshot snapshot = metricsSnapshot();
+    std::string tmpFilename = std::string(filename) + ".tmp";
+    FILE* file = fopen(tmpFilename.c_str(), "w");
+    if (!file) return false;
+    for (int i = 0; i < METRIC_COUNT; ++i) {
+        fprintf(file, "# HELP %s%s %s\n# TYPE %s%s counter\n", prefix, METRIC_NAMES[i], METRIC_HELP[i], prefix, METRIC_NAMES[i]);
+        if (i == METRIC_FENCE_WAIT_NS) {
+            fprintf(file, "%s%s %.9f\n", prefix, METRIC_NAMES[i], snapshot.values[i] / 1e9);
+        } else {
+            fprintf(file, "%s%s %llu\n", prefix, METRIC_NAMES[i], (unsigned long long)snapshot.values[i]);
+        }
+    }
+    bool failed = ferror(file) != 0;
+    if (fclose(file) != 0) failed = true;
+    // rename doesn't replace an existing file on Windows, so remove it first there.
+#ifdef _WIN32
+    if (!failed) remove(filename);
+#endif
+    if (!failed && rename(tmpFilename.c_str(), filename) != 0) failed = true;
+    if (failed) remove(tmpFilename.c_str());
+    return !failed;
+}
+
+#endif /*METRICS_H*/
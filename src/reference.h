@@ -0,0 +1,124 @@
+/*
+A scalar C++ reference of what the compute shaders render, and a tolerance-aware comparison of
+an image against it. main.cpp verifies the buffer of every shader and schedule with it (--verify),
+tools/verify.cpp checks saved images, and the benchmarks use it to make their input without a GPU.
+*/
+#ifndef REFERENCE_H
+#define REFERENCE_H
+
+#include <math.h>
+#include <stddef.h>
+#include <vector>
+
+const int REFERENCE_ITERATIONS = 128; // M in the shaders.
+
+/*
+How far a color channel may be from the reference: an 8-bit png truncates the colors by less than this,
+and the cosine of the GPU is well within it.
+*/
+const double REFERENCE_TOLERANCE = 1.0 / 255.0;
+
+/*
+The fraction of pixels that may differ from the reference and still pass. Near the boundary of the set
+the iterations depend on the last bit of the floats, which the GPU may round differently.
+*/
+const double REFERENCE_MAX_MISMATCH_FRACTION = 0.001;
+
+/*
+The iterations pixel (px, py) of a w x h image takes in the shaders, `n` in shader.comp, for the view
+at center (cx, cy) with width and height `scale`. REFERENCE_ITERATIONS means the pixel is inside the set.
+The GPU may round differently, or fuse multiplies and adds, so near the boundary of the set
+a pixel can take a different number of iterations there.
+*/
+inline int referenceIterations(unsigned px, unsigned py, unsigned w, unsigned h, float cx, float cy, float scale) {
+    float x0 = cx + (float(px) / float(w) - 0.5f) * scale;
+    float y0 = cy + (float(py) / float(h) - 0.5f) * scale;
+    float zx = 0, zy = 0;
+    int n = 0;
+    for (int i = 0; i < REFERENCE_ITERATIONS; ++i) {
+        float x = zx * zx - zy * zy + x0;
+        zy = 2.0f * zx * zy + y0;
+        zx = x;
+        if (zx * zx + zy * zy > 2) break;
+        ++n;
+    }
+    return n;
+}
+
+// The cosine palette of the shaders: the RGB floats of a pixel that did n iterations.
+inline void referenceColor(int n, float* rgb) {
+    const float d[3] = { 0.3f, 0.3f, 0.5f }, e[3] = { -0.2f, -0.3f, -0.5f };
+    const float f[3] = { 2.1f, 2.0f, 3.0f }, g[3] = { 0.0f, 0.1f, 0.0f };
+    float t = float(n) / float(REFERENCE_ITERATIONS);
+    for (int c = 0; c < 3; ++c) {
+        rgb[c] = d[c] + e[c] * cosf(6.28318f * (f[c] * t + g[c]));
+    }
+}
+
+// The RGBA floats shader.comp renders at w x h, of the view at center (cx, cy) with width and height `scale`.
+inline std::vector<float> renderReference(unsigned w, unsigned h, float cx = -0.445f, float cy = 0.0f, float scale = 2.34f) {
+    std::vector<float> image(4 * (size_t)w * h);
+    for (unsigned py = 0; py < h; ++py) {
+        for (unsigned px = 0; px < w; ++px) {
+            float* pixel = &image[4 * ((size_t)w * py + px)];
+            referenceColor(referenceIterations(px, py, w, h, cx, cy, scale), pixel);
+            pixel[3] = 1.0f;
+        }
+    }
+    return image;
+}
+
+// The iterations of every pixel of a w x h image of the view, row after row.
+inline std::vector<unsigned char> renderReferenceIterations(unsigned w, unsigned h, float cx, float cy, float scale) {
+    std::vector<unsigned char> iterations((size_t)w * h);
+    for (unsigned py = 0; py < h; ++py) {
+        for (unsigned px = 0; px < w; ++px) {
+            iterations[(size_t)w * py + px] = (unsigned char)referenceIterations(px, py, w, h, cx, cy, scale);
+        }
+    }
+    return iterations;
+}
+
+// How an image differs from the reference.
+struct ReferenceDiff {
+    size_t pixels;
+    size_t mismatches; // pixels with a channel that differs by more than the tolerance.
+    double maxError; // the largest difference of a channel.
+    double meanError; // the mean difference of a channel.
+
+    double mismatchFraction() const {
+        return pixels ? double(mismatches) / pixels : 0.0;
+    }
+};
+
+/*
+Compares `channels` channels of every pixel of a w x h image. actual(x, y, c) and expected(x, y, c)
+return channel c of pixel (x, y) as a number: a color, an iteration count or a mask bit. A pixel with
+a channel that differs by more than tolerance is a mismatch, and if mismatchMap isn't NULL, its
+w * h bytes are set to 255 for the mismatches and to 0 for the others.
+*/
+template<typename Actual, typename Expected>
+ReferenceDiff diffAgainstReference(unsigned w, unsigned h, int channels, double tolerance,
+                                   Actual actual, Expected expected, unsigned char* mismatchMap) {
+    ReferenceDiff diff = { (size_t)w * h, 0, 0.0, 0.0 };
+    double total = 0.0;
+    for (unsigned y = 0; y < h; ++y) {
+        for (unsigned x = 0; x < w; ++x) {
+            bool mismatch = false;
+            for (int c = 0; c < channels; ++c) {
+                double a = actual(x, y, c), e = expected(x, y, c);
+                // NaN is as far off as it gets.
+                double error = a == a ? fabs(a - e) : HUGE_VAL;
+                total += error;
+                if (error > diff.maxError) diff.maxError = error;
+                if (error > tolerance) mismatch = true;
+            }
+            if (mismatch) ++diff.mismatches;
+            if (mismatchMap) mismatchMap[(size_t)w * y + x] = mismatch ? 255 : 0;
+        }
+    }
+    diff.meanError = diff.pixels ? total / (double(diff.pixels) * channels) : 0.0;
+    return diff;
+}
+
+#endif /*REFERENCE_H*/
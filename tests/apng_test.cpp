@@ -0,0 +1,233 @@
+/*
+Writes animated PNGs with lodepng_animation_add in several color modes, then decodes every frame and
+checks that the composed frames are the images that were added. LodePNG doesn't decode APNG, so every
+frame is turned into a PNG of its own: the IHDR and PLTE of the file with the size of the frame, and the
+data of its IDAT or fdAT chunks, drawn over the previous frame at its offset.
+
+Also checks that a frame with another color mode than the first one is refused with error 95, even
+when its pixels take as many bytes, and that nothing can be added after lodepng_animation_finish.
+
+lodepng.cpp is included rather than linked, to reach its static bit functions.
+Exits with 1 if anything fails, for ctest.
+*/
+
+#include "lodepng.cpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+static int failures = 0;
+
+static void fail(const std::string& name, const char* what) {
+    printf("FAILED: %s: %s\n", name.c_str(), what);
+    ++failures;
+}
+
+// The area and place of a frame in the animation, and the zlib data of its pixels.
+struct Frame {
+    unsigned w, h, x, y;
+    std::vector<unsigned char> zlib;
+};
+
+/*
+Decodes the frames of the APNG png to images in the color mode raw, every one drawn over the one before.
+Returns false if the chunks aren't as lodepng_animation_add writes them.
+*/
+static bool decodeAnimation(const std::vector<unsigned char>& png, const LodePNGColorMode& raw, unsigned w, unsigned h,
+                            std::vector<std::vector<unsigned char> >& images) {
+    const unsigned char* ihdr = NULL;
+    std::vector<unsigned char> headerChunks; // the chunks between IHDR and the first IDAT, such as PLTE.
+    std::vector<Frame> frames;
+    unsigned numFrames = 0, sequence = 0;
+    bool pastIdat = false;
+    const unsigned char* end = png.data() + png.size();
+    for (const unsigned char* chunk = png.data() + 8; chunk + 12 <= end; chunk = lodepng_chunk_next_const(chunk)) {
+        const unsigned char* data = lodepng_chunk_data_const(chunk);
+        unsigned length = lodepng_chunk_length(chunk);
+        if (lodepng_chunk_check_crc(chunk)) return false;
+        if (lodepng_chunk_type_equals(chunk, "IHDR")) {
+            ihdr = chunk;
+        } else if (lodepng_chunk_type_equals(chunk, "acTL")) {
+            numFrames = lodepng_read32bitInt(data);
+        } else if (lodepng_chunk_type_equals(chunk, "fcTL")) {
+            // dispose_op none and blend_op source, so a frame simply replaces its rectangle.
+            if (lodepng_read32bitInt(data) != sequence++ || data[24] != 0 || data[25] != 0) return false;
+            Frame frame = { lodepng_read32bitInt(&data[4]), lodepng_read32bitInt(&data[8]),
+                            lodepng_read32bitInt(&data[12]), lodepng_read32bitInt(&data[16]), {} };
+            frames.push_back(frame);
+        } else if (lodepng_chunk_type_equals(chunk, "IDAT")) {
+            if (frames.size() != 1) return false;
+            pastIdat = true;
+            frames.back().zlib.insert(frames.back().zlib.end(), data, data + length);
+        } else if (lodepng_chunk_type_equals(chunk, "fdAT")) {
+            if (frames.size() < 2 || lodepng_read32bitInt(data) != sequence++) return false;
+            frames.back().zlib.insert(frames.back().zlib.end(), data + 4, data + length);
+        } else if (lodepng_chunk_type_equals(chunk, "IEND")) {
+            break;
+        } else if (!pastIdat && !lodepng_chunk_type_equals(chunk, "tEXt")) {
+            headerChunks.insert(headerChunks.end(), chunk, chunk + length + 12);
+        }
+    }
+    if (!ihdr || numFrames != frames.size()) return false;
+
+    unsigned bpp = lodepng_get_bpp(&raw);
+    std::vector<unsigned char> canvas(lodepng_get_raw_size(w, h, &raw), 0);
+    images.clear();
+    for (size_t i = 0; i < frames.size(); ++i) {
+        const Frame& frame = frames[i];
+        if (frame.x + frame.w > w || frame.y + frame.h > h) return false;
+        std::vector<unsigned char> framePng(png.begin(), png.begin() + 8);
+        std::vector<unsigned char> frameIhdr(ihdr, ihdr + 25);
+        lodepng_set32bitInt(&frameIhdr[8], frame.w);
+        lodepng_set32bitInt(&frameIhdr[12], frame.h);
+        lodepng_chunk_generate_crc(frameIhdr.data());
+        framePng.insert(framePng.end(), frameIhdr.begin(), frameIhdr.end());
+        framePng.insert(framePng.end(), headerChunks.begin(), headerChunks.end());
+
+        unsigned char* buffer = (unsigned char*)malloc(framePng.size());
+        size_t buffersize = framePng.size();
+        memcpy(buffer, framePng.data(), buffersize);
+        lodepng_chunk_create(&buffer, &buffersize, (unsigned)frame.zlib.size(), "IDAT", frame.zlib.data());
+        lodepng_chunk_create(&buffer, &buffersize, 0, "IEND", NULL);
+
+        LodePNGState state;
+        lodepng_state_init(&state);
+        lodepng_color_mode_copy(&state.info_raw, &raw);
+        unsigned char* image = NULL;
+        unsigned fw = 0, fh = 0;
+        unsigned error = lodepng_decode(&image, &fw, &fh, &state, buffer, buffersize);
+        free(buffer);
+        lodepng_state_cleanup(&state);
+        if (error) return false;
+
+        for (unsigned y = 0; y < fh; ++y) {
+            for (unsigned x = 0; x < fw; ++x) {
+                size_t in = ((size_t)y * fw + x) * bpp, out = ((size_t)(y + frame.y) * w + x + frame.x) * bpp;
+                for (unsigned b = 0; b < bpp; ++b) setBitOfReversedStream(&out, canvas.data(), readBitFromReversedStream(&in, image));
+            }
+        }
+        free(image);
+        images.push_back(canvas);
+    }
+    return true;
+}
+
+// Deterministic bytes, so a failure reproduces.
+static unsigned char nextByte(unsigned& state) {
+    state = state * 1103515245u + 12345u;
+    return (unsigned char)(state >> 16);
+}
+
+/*
+Adds numFrames frames of w x h pixels in the raw color mode to an animation stored in the png color mode,
+each changing a rectangle of the one before, or nothing every fourth frame, and checks the decoded frames.
+*/
+static void testAnimation(const std::string& name, LodePNGColorType rawType, unsigned rawDepth,
+                          LodePNGColorType pngType, unsigned pngDepth, unsigned w, unsigned h,
+                          unsigned numFrames, unsigned interlace) {
+    LodePNGState state;
+    lodepng_state_init(&state);
+    state.info_raw.colortype = rawType;
+    state.info_raw.bitdepth = rawDepth;
+    state.info_png.color.colortype = pngType;
+    state.info_png.color.bitdepth = pngDepth;
+    state.info_png.interlace_method = interlace;
+    if (pngType == LCT_PALETTE) {
+        for (unsigned i = 0; i < (1u << pngDepth); ++i) lodepng_palette_add(&state.info_png.color, i * 7, 255 - i * 3, i, 255);
+        lodepng_color_mode_copy(&state.info_raw, &state.info_png.color);
+    }
+
+    // The bits of a frame after the last pixel are zero, as the decoder leaves them.
+    size_t bits = (size_t)w * h * lodepng_get_bpp(&state.info_raw);
+    std::vector<unsigned char> image(lodepng_get_raw_size(w, h, &state.info_raw), 0);
+    std::vector<std::vector<unsigned char> > added;
+    unsigned random = 1;
+    LodePNGAnimation animation;
+    lodepng_animation_init(&animation);
+    for (unsigned f = 0; f < numFrames; ++f) {
+        if (f == 0 || f % 4 != 3) {
+            unsigned x0 = nextByte(random) % w, y0 = nextByte(random) % h;
+            unsigned x1 = x0 + 1 + nextByte(random) % (w - x0), y1 = y0 + 1 + nextByte(random) % (h - y0);
+            if (f == 0) x0 = y0 = 0, x1 = w, y1 = h;
+            unsigned bpp = lodepng_get_bpp(&state.info_raw);
+            for (unsigned y = y0; y < y1; ++y) {
+                for (unsigned x = x0; x < x1; ++x) {
+                    size_t bp = ((size_t)y * w + x) * bpp;
+                    for (unsigned b = 0; b < bpp; ++b) setBitOfReversedStream(&bp, image.data(), nextByte(random) & 1);
+                }
+            }
+            if (bits % 8) image.back() &= (unsigned char)(0xFF << (8 - bits % 8));
+            // Stored without alpha, the pixels must be opaque to decode the same.
+            if (rawType == LCT_RGBA && pngType == LCT_RGB) for (size_t i = 3; i < image.size(); i += 4) image[i] = 255;
+        }
+        added.push_back(image);
+        unsigned error = lodepng_animation_add(&animation, image.data(), w, h, 1, 25, &state);
+        if (error) {
+            fail(name, lodepng_error_text(error));
+            lodepng_animation_cleanup(&animation);
+            lodepng_state_cleanup(&state);
+            return;
+        }
+    }
+    if (lodepng_animation_finish(&animation)) fail(name, "lodepng_animation_finish failed");
+
+    std::vector<unsigned char> png(animation.data, animation.data + animation.size);
+    std::vector<std::vector<unsigned char> > decoded;
+    if (!decodeAnimation(png, state.info_raw, w, h, decoded)) fail(name, "the APNG chunks can't be decoded");
+    else if (decoded != added) fail(name, "the decoded frames differ from the added ones");
+
+    // A decoder without APNG support shows the first frame.
+    lodepng::State decodeState;
+    lodepng_color_mode_copy(&decodeState.info_raw, &state.info_raw);
+    std::vector<unsigned char> first;
+    unsigned dw = 0, dh = 0;
+    if (lodepng::decode(first, dw, dh, decodeState, png) || first != added[0]) {
+        fail(name, "the first frame doesn't decode as a PNG");
+    }
+
+    if (lodepng_animation_add(&animation, image.data(), w, h, 1, 25, &state) != 98) {
+        fail(name, "a frame was added after lodepng_animation_finish");
+    }
+    printf("%-12s %3ux%-3u %2u frames, %6zu bytes: %s\n", name.c_str(), w, h, numFrames, png.size(),
+        decoded == added ? "ok" : "FAILED");
+    lodepng_animation_cleanup(&animation);
+    lodepng_state_cleanup(&state);
+}
+
+// Adds a second frame of the same size in bytes as the first but in another color mode, which must fail.
+static void testColorModeChange(const std::string& name, bool changeRaw) {
+    const unsigned w = 16, h = 8;
+    std::vector<unsigned char> image(w * h * 4, 128);
+    LodePNGState state;
+    lodepng_state_init(&state);
+    LodePNGAnimation animation;
+    lodepng_animation_init(&animation);
+    if (lodepng_animation_add(&animation, image.data(), w, h, 1, 25, &state)) fail(name, "the first frame failed");
+    if (changeRaw) {
+        // 16-bit grey with alpha also takes 4 bytes per pixel.
+        state.info_raw.colortype = LCT_GREY_ALPHA;
+        state.info_raw.bitdepth = 16;
+    } else {
+        state.info_png.color.colortype = LCT_RGB;
+    }
+    if (lodepng_animation_add(&animation, image.data(), w, h, 1, 25, &state) != 95) {
+        fail(name, "a frame in another color mode was accepted");
+    }
+    lodepng_animation_cleanup(&animation);
+    lodepng_state_cleanup(&state);
+}
+
+int main() {
+    testAnimation("rgba8", LCT_RGBA, 8, LCT_RGBA, 8, 120, 90, 12, 0);
+    testAnimation("rgba8-rgb8", LCT_RGBA, 8, LCT_RGB, 8, 64, 48, 6, 0);
+    testAnimation("palette4", LCT_PALETTE, 4, LCT_PALETTE, 4, 37, 29, 12, 0);
+    testAnimation("grey1", LCT_GREY, 1, LCT_GREY, 1, 45, 30, 12, 0);
+    testAnimation("rgb16-adam7", LCT_RGB, 16, LCT_RGB, 16, 40, 33, 8, 1);
+    testColorModeChange("raw-change", true);
+    testColorModeChange("png-change", false);
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,125 @@
+/*
+Checks that every specialized conversion of lodepng_convert, the color_convert_fast_paths table, gives
+byte for byte the result of the generic conversion, one pixel at a time through getPixelColorRGBA8 and
+rgba8ToPixel. The inputs have every byte value in every channel, the modes have color keys or not,
+and the palettes have every size from 0 to 256 entries.
+
+lodepng.cpp is included rather than linked, to reach its static functions.
+Exits with 1 if any conversion differs, for ctest.
+*/
+
+#include "lodepng.cpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+// Deterministic bytes, so a failure reproduces.
+static unsigned char nextByte(unsigned& state) {
+    state = state * 1103515245u + 12345u;
+    return (unsigned char)(state >> 16);
+}
+
+// The conversion of lodepng_convert without its fast paths, for any output mode that is not a palette.
+static void convertGeneric(std::vector<unsigned char>& out, const std::vector<unsigned char>& in,
+                           const LodePNGColorMode* mode_out, const LodePNGColorMode* mode_in, size_t numpixels) {
+    ColorTree tree;
+    color_tree_init(&tree);
+    for (size_t i = 0; i < numpixels; ++i) {
+        unsigned char r = 0, g = 0, b = 0, a = 0;
+        getPixelColorRGBA8(&r, &g, &b, &a, in.data(), i, mode_in);
+        rgba8ToPixel(out.data(), i, mode_out, &tree, r, g, b, a);
+    }
+    color_tree_cleanup(&tree);
+}
+
+/*
+Input pixels of the given mode: first one where every byte of the pixel is i, for every byte value i,
+then ones where every byte is i plus its position times a different odd number, so each channel
+meets each value next to all kinds of other channels, then random ones.
+*/
+static std::vector<unsigned char> makeInput(const LodePNGColorMode* mode, size_t& numpixels) {
+    size_t bytes = lodepng_get_bpp(mode) / 8;
+    numpixels = 256 * 3 + 4096;
+    std::vector<unsigned char> in(numpixels * bytes);
+    unsigned state = 1;
+    for (size_t i = 0; i < numpixels; ++i) {
+        for (size_t c = 0; c < bytes; ++c) {
+            if (i < 256) in[i * bytes + c] = (unsigned char)i;
+            else if (i < 256 * 3) in[i * bytes + c] = (unsigned char)(i + c * (i < 512 ? 67 : 151));
+            else in[i * bytes + c] = nextByte(state);
+        }
+    }
+    return in;
+}
+
+// Sets a color key to the color of the given input pixel, so some pixels match it.
+static void setKey(LodePNGColorMode* mode, const std::vector<unsigned char>& in, const LodePNGColorMode* mode_in, size_t pixel) {
+    unsigned short r = 0, g = 0, b = 0, a = 0;
+    getPixelColorRGBA16(&r, &g, &b, &a, in.data(), pixel, mode_in);
+    mode->key_defined = 1;
+    mode->key_r = mode->bitdepth == 16 ? r : r >> 8;
+    mode->key_g = mode->bitdepth == 16 ? g : g >> 8;
+    mode->key_b = mode->bitdepth == 16 ? b : b >> 8;
+}
+
+// Compares the fast path of one table entry with the generic conversion, returns the number of failures.
+static int testFastPath(const ColorConvertFastPath& path) {
+    int failures = 0;
+    bool palette = path.colortype_in == LCT_PALETTE;
+    for (unsigned palettesize = 0; palettesize <= (palette ? 256u : 0u); ++palettesize) {
+        for (int keys = 0; keys < 4; ++keys) {
+            LodePNGColorMode mode_in, mode_out;
+            lodepng_color_mode_init(&mode_in);
+            lodepng_color_mode_init(&mode_out);
+            mode_in.colortype = path.colortype_in;
+            mode_in.bitdepth = path.bitdepth_in;
+            mode_out.colortype = path.colortype_out;
+            mode_out.bitdepth = path.bitdepth_out;
+
+            unsigned state = palettesize + 1;
+            for (unsigned i = 0; i < palettesize; ++i) {
+                lodepng_palette_add(&mode_in, nextByte(state), nextByte(state), nextByte(state), nextByte(state));
+            }
+            if (getColorConvertFastPath(&mode_out, &mode_in) != path.convert) {
+                printf("FAILED: the table doesn't give the fast path of %d/%u to %d/%u\n",
+                    path.colortype_in, path.bitdepth_in, path.colortype_out, path.bitdepth_out);
+                ++failures;
+            }
+
+            size_t numpixels = 0;
+            std::vector<unsigned char> in = makeInput(&mode_in, numpixels);
+            // No key, a key on the input, on the output, or on both; pixel 300 is an ordinary color.
+            if (keys & 1) setKey(&mode_in, in, &mode_in, 300);
+            if (keys & 2) setKey(&mode_out, in, &mode_in, 300);
+
+            size_t outsize = numpixels * (lodepng_get_bpp(&mode_out) / 8);
+            // Different fill bytes, so a byte one of them doesn't write shows up.
+            std::vector<unsigned char> fast(outsize, 0xA5), generic(outsize, 0x5A);
+            unsigned error = lodepng_convert(fast.data(), in.data(), &mode_out, &mode_in, (unsigned)numpixels, 1);
+            convertGeneric(generic, in, &mode_out, &mode_in, numpixels);
+            if (error || fast != generic) {
+                size_t first = 0;
+                while (first < outsize && fast[first] == generic[first]) ++first;
+                printf("FAILED: %d/%u to %d/%u, palette size %u, keys %d: error %u, first difference at byte %zu\n",
+                    path.colortype_in, path.bitdepth_in, path.colortype_out, path.bitdepth_out, palettesize, keys,
+                    error, first);
+                ++failures;
+            }
+            lodepng_color_mode_cleanup(&mode_in);
+            lodepng_color_mode_cleanup(&mode_out);
+        }
+    }
+    return failures;
+}
+
+int main() {
+    int failures = 0;
+    size_t count = sizeof(color_convert_fast_paths) / sizeof(color_convert_fast_paths[0]);
+    for (size_t i = 0; i < count; ++i) {
+        failures += testFastPath(color_convert_fast_paths[i]);
+    }
+    printf("%zu fast paths: %s\n", count, failures ? "FAILED" : "ok");
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,147 @@
+/*
+Checks an image saved by vulkan_minimal_compute against the CPU reference of src/reference.h, so a
+render of any backend or kernel can be checked after the fact, for instance one made on a machine
+without a display by lavapipe. It takes the mandelbrot.png of the float and the palette output,
+8 or 16 bits, the 1-bit mandelbrot.png of --mask, and mandelbrot.pfm.
+
+Usage: verify IMAGE [--view CX CY SCALE] [--tolerance T] [--max-mismatch FRACTION] [--map MAP.png]
+
+The reference is rendered at the size of the image, of the view at center (CX, CY) with width and
+height SCALE, the default view of shader.comp unless given. A pixel with a channel that is further
+than T from the reference is a mismatch (the colors go from 0 to 1, a mask pixel is 0 or 1).
+It prints the largest and the mean error and the mismatches, and saves them in white to MAP.png.
+Exits with 1 if more than FRACTION of the pixels are mismatches, so it can fail a CI job.
+*/
+
+#include "lodepng.h"
+#include "reference.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Reads a color pfm, as vulkan_minimal_compute --pfm saves it, to RGB floats from the top row down.
+static bool loadPfm(const char* filename, std::vector<float>& rgb, unsigned& w, unsigned& h) {
+    FILE* file = fopen(filename, "rb");
+    if (!file) return false;
+    char magic[3] = { 0 };
+    double scale = 0;
+    // A single whitespace character separates the header from the floats.
+    bool ok = fscanf(file, "%2s %u %u %lf", magic, &w, &h, &scale) == 4 && strcmp(magic, "PF") == 0 && fgetc(file) != EOF;
+    if (ok) {
+        rgb.resize(3 * (size_t)w * h);
+        for (unsigned y = 0; y < h && ok; ++y) {
+            // The rows go from the bottom to the top.
+            ok = fread(&rgb[3 * (size_t)w * (h - 1 - y)], sizeof(float), 3 * w, file) == 3 * w;
+        }
+    }
+    fclose(file);
+    if (!ok) return false;
+
+    // A negative scale means the floats are little endian.
+    const uint16_t endianTest = 1;
+    bool littleEndian = *(const unsigned char*)&endianTest == 1;
+    if ((scale < 0) != littleEndian) {
+        for (size_t i = 0; i < rgb.size(); ++i) {
+            unsigned char* b = (unsigned char*)&rgb[i];
+            std::swap(b[0], b[3]);
+            std::swap(b[1], b[2]);
+        }
+    }
+    return true;
+}
+
+static bool endsWith(const std::string& s, const char* suffix) {
+    size_t n = strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+int main(int argc, char** argv) {
+    const char* filename = NULL;
+    const char* mapFile = NULL;
+    float cx = -0.445f, cy = 0.0f, scale = 2.34f;
+    double tolerance = REFERENCE_TOLERANCE;
+    double maxMismatch = REFERENCE_MAX_MISMATCH_FRACTION;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--view") == 0 && i + 3 < argc) {
+            cx = (float)atof(argv[++i]);
+            cy = (float)atof(argv[++i]);
+            scale = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+            tolerance = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--max-mismatch") == 0 && i + 1 < argc) {
+            maxMismatch = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--map") == 0 && i + 1 < argc) {
+            mapFile = argv[++i];
+        } else if (argv[i][0] != '-' && !filename) {
+            filename = argv[i];
+        } else {
+            filename = NULL;
+            break;
+        }
+    }
+    if (!filename) {
+        printf("usage: %s IMAGE [--view CX CY SCALE] [--tolerance T] [--max-mismatch FRACTION] [--map MAP.png]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    unsigned w = 0, h = 0;
+    int channels = 3;
+    std::vector<float> pixels; // `channels` floats per pixel, row after row.
+    bool mask = false;
+    if (endsWith(filename, ".pfm")) {
+        if (!loadPfm(filename, pixels, w, h)) {
+            printf("can't read %s as a color pfm\n", filename);
+            return EXIT_FAILURE;
+        }
+    } else {
+        std::vector<unsigned char> png, decoded;
+        unsigned error = lodepng::load_file(png, filename);
+        lodepng::State state;
+        if (!error) error = lodepng_inspect(&w, &h, &state, png.data(), png.size());
+        if (error) {
+            printf("error %u: %s\n", error, lodepng_error_text(error));
+            return EXIT_FAILURE;
+        }
+        // The 1-bit greyscale png of --mask is white inside the set, any other png has the colors.
+        mask = state.info_png.color.colortype == LCT_GREY && state.info_png.color.bitdepth == 1;
+        channels = mask ? 1 : 3;
+        error = lodepng::decode(decoded, w, h, png, mask ? LCT_GREY : LCT_RGB, mask ? 8 : 16);
+        if (error) {
+            printf("error %u: %s\n", error, lodepng_error_text(error));
+            return EXIT_FAILURE;
+        }
+        pixels.resize((size_t)channels * w * h);
+        for (size_t i = 0; i < pixels.size(); ++i) {
+            pixels[i] = mask ? (decoded[i] ? 1.0f : 0.0f) : (decoded[2 * i] * 256 + decoded[2 * i + 1]) / 65535.0f;
+        }
+    }
+
+    std::vector<unsigned char> iterations = renderReferenceIterations(w, h, cx, cy, scale);
+    float colors[REFERENCE_ITERATIONS + 1][3];
+    for (int n = 0; n <= REFERENCE_ITERATIONS; ++n) {
+        referenceColor(n, colors[n]);
+    }
+    std::vector<unsigned char> mismatchMap((size_t)w * h);
+    ReferenceDiff diff = diffAgainstReference(w, h, channels, tolerance,
+        [&](unsigned x, unsigned y, int c) { return double(pixels[channels * ((size_t)w * y + x) + c]); },
+        [&](unsigned x, unsigned y, int c) {
+            int n = iterations[(size_t)w * y + x];
+            return mask ? (n == REFERENCE_ITERATIONS ? 1.0 : 0.0) : double(colors[n][c]);
+        },
+        mismatchMap.data());
+
+    bool passed = diff.mismatchFraction() <= maxMismatch;
+    printf("%s: %ux%u, max error %.6f, mean error %.6f, %zu of %zu pixels differ (%.4f%%): %s\n", filename, w, h,
+        diff.maxError, diff.meanError, diff.mismatches, diff.pixels, 100.0 * diff.mismatchFraction(),
+        passed ? "ok" : "FAILED");
+    if (mapFile) {
+        unsigned error = lodepng::encode(mapFile, mismatchMap, w, h, LCT_GREY, 8);
+        if (error) printf("error %u: %s\n", error, lodepng_error_text(error));
+    }
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}